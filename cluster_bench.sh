@@ -0,0 +1,254 @@
+#!/bin/bash
+
+# End-to-end benchmark of a local cluster: generate a dataset, start
+# whoServer and master (with its workers) on loopback, wait until every
+# worker has sent its statistics, then drive whoClient -bench against it.
+# Results (and the output of every process) go to the output directory.
+
+ERR_USAGE=1
+ERR_FILE=2
+ERR_NUM=3
+ERR_START=4
+
+usage() {
+	echo "Usage: $0 [-o outputDir] [-i input_dir | -c numCountries -f numFilesPerDirectory -r numRecordsPerFile]"
+	echo "          [-W numWorkers] [-t serverThreads] [-b bufferSize] [-w clientThreads]"
+	echo "          [-q queryFile | -n numQueries] [-N count] [-R rate] [-T timeoutSeconds]"
+	exit $ERR_USAGE
+}
+
+ROOT="$(dirname "$(readlink -f "$0")")"
+
+OUT="cluster_bench"
+INPUT_DIR=""
+COUNTRIES=10
+FILES_PER_DIR=10
+RECORDS_PER_FILE=20
+WORKERS=4
+SERVER_THREADS=8
+BUFFER_SIZE=64
+CLIENT_THREADS=8
+QUERY_FILE=""
+QUERIES=1000
+COUNT=0
+RATE=0
+TIMEOUT=300
+
+while getopts "o:i:c:f:r:W:t:b:w:q:n:N:R:T:" opt; do
+	case "$opt" in
+	o) OUT="$OPTARG" ;;
+	i) INPUT_DIR="$(readlink -f "$OPTARG")" ;;
+	c) COUNTRIES="$OPTARG" ;;
+	f) FILES_PER_DIR="$OPTARG" ;;
+	r) RECORDS_PER_FILE="$OPTARG" ;;
+	W) WORKERS="$OPTARG" ;;
+	t) SERVER_THREADS="$OPTARG" ;;
+	b) BUFFER_SIZE="$OPTARG" ;;
+	w) CLIENT_THREADS="$OPTARG" ;;
+	q) QUERY_FILE="$(readlink -f "$OPTARG")" ;;
+	n) QUERIES="$OPTARG" ;;
+	N) COUNT="$OPTARG" ;;
+	R) RATE="$OPTARG" ;;
+	T) TIMEOUT="$OPTARG" ;;
+	*) usage ;;
+	esac
+done
+
+# Checks
+
+INT='^[0-9]+$'
+for n in "$COUNTRIES" "$FILES_PER_DIR" "$RECORDS_PER_FILE" "$WORKERS" \
+         "$SERVER_THREADS" "$BUFFER_SIZE" "$CLIENT_THREADS" "$QUERIES" \
+         "$COUNT" "$TIMEOUT"; do
+	if ! [[ "$n" =~ $INT ]]; then
+		echo "Not a number: $n"
+		exit $ERR_NUM
+	fi
+done
+
+for f in whoServer master whoClient create_infiles; do
+	if [ ! -x "$ROOT/$f" ]; then
+		echo "$ROOT/$f not found (make first)"
+		exit $ERR_FILE
+	fi
+done
+
+if [ -n "$INPUT_DIR" ] && [ ! -d "$INPUT_DIR" ]; then
+	echo "Directory not found: $INPUT_DIR"
+	exit $ERR_FILE
+elif [ -n "$QUERY_FILE" ] && [ ! -f "$QUERY_FILE" ]; then
+	echo "File not found: $QUERY_FILE"
+	exit $ERR_FILE
+fi
+
+mkdir -p "$OUT"
+OUT="$(readlink -f "$OUT")"
+
+# Everything the processes write (logs/, traces/) stays in there
+cd "$OUT" || exit $ERR_FILE
+rm -rf logs traces
+
+now() {
+	date +%s.%N
+}
+
+# Seconds from $1 to $2
+elapsed() {
+	echo "$1 $2" | awk '{ printf "%.3f", $2 - $1 }'
+}
+
+# Ask the kernel for a free port: bind to port 0
+free_port() {
+	python3 -c 'import socket; s = socket.socket(); s.bind(("127.0.0.1", 0)); print(s.getsockname()[1])'
+}
+
+# Is anyone listening on TCP port $1?
+listening() {
+	grep -qi ":$(printf '%04X' "$1") [0-9A-F:]* 0A " /proc/net/tcp
+}
+
+# Send a single query (whoClient prints the query, then the response)
+query() {
+	echo "$1" > query.txt
+	"$ROOT/whoClient" -q query.txt -w 1 -sp "$QUERY_PORT" -sip 127.0.0.1 2> /dev/null
+}
+
+SERVER_PID=""
+MASTER_PID=""
+
+# Master kills its workers on SIGINT; whoServer waits for its threads
+teardown() {
+	[ -n "$MASTER_PID" ] && kill -INT "$MASTER_PID" 2> /dev/null && wait "$MASTER_PID"
+	[ -n "$SERVER_PID" ] && kill -INT "$SERVER_PID" 2> /dev/null && wait "$SERVER_PID"
+	MASTER_PID=""
+	SERVER_PID=""
+}
+
+trap teardown EXIT
+trap 'exit $ERR_START' INT TERM
+
+# Dataset
+
+if [ -z "$INPUT_DIR" ]; then
+	INPUT_DIR="$OUT/db"
+	rm -rf "$INPUT_DIR"
+
+	head -n "$COUNTRIES" "$ROOT/data/countries.txt" > countries.txt
+
+	echo "Generating $COUNTRIES x $FILES_PER_DIR files of $RECORDS_PER_FILE records..."
+	"$ROOT/create_infiles" -t "$(nproc)" -s 1 "$ROOT/data/diseases.txt" countries.txt \
+		"$INPUT_DIR" "$FILES_PER_DIR" "$RECORDS_PER_FILE" || exit $ERR_FILE
+fi
+
+RECORDS=$(cat "$INPUT_DIR"/*/* | wc -l)
+FILES=$(ls "$INPUT_DIR"/*/* | wc -l)
+
+# The master starts no more workers than there are directories
+DIRS=$(ls "$INPUT_DIR" | wc -l)
+[ "$WORKERS" -gt "$DIRS" ] && WORKERS=$DIRS
+
+if [ -z "$QUERY_FILE" ]; then
+	QUERY_FILE="$OUT/queries.txt"
+
+	ls "$INPUT_DIR" > query_countries.txt
+
+	python3 "$ROOT/create_queryfiles.py" --queryFile "$QUERY_FILE" \
+		--numQueries "$QUERIES" --seed 1 \
+		--commandsFile "$ROOT/data/commands.txt" \
+		--countriesFile query_countries.txt \
+		--diseasesFile "$ROOT/data/diseases.txt" \
+		--maxRecordID "$RECORDS" \
+		--startDate 01-01-2000 --endDate 28-12-2019 > /dev/null || exit $ERR_FILE
+fi
+
+# Cluster
+
+QUERY_PORT=$(free_port)
+STATS_PORT=$(free_port)
+
+while [ "$STATS_PORT" -eq "$QUERY_PORT" ]; do
+	STATS_PORT=$(free_port)
+done
+
+echo "Starting whoServer (query port $QUERY_PORT, statistics port $STATS_PORT)..."
+
+"$ROOT/whoServer" -q "$QUERY_PORT" -s "$STATS_PORT" -w "$SERVER_THREADS" \
+	-b "$BUFFER_SIZE" -v 0 > server.out 2> server.err &
+SERVER_PID=$!
+
+for ((i = 0; i < 100; i++)); do
+	listening "$QUERY_PORT" && listening "$STATS_PORT" && break
+
+	if ! kill -0 "$SERVER_PID" 2> /dev/null; then
+		echo "whoServer exited, see $OUT/server.err"
+		exit $ERR_START
+	fi
+
+	sleep 0.05
+done
+
+echo "Starting master with $WORKERS workers ($FILES files, $RECORDS records)..."
+
+START=$(now)
+
+"$ROOT/master" -w "$WORKERS" -b "$BUFFER_SIZE" -s 127.0.0.1 -p "$STATS_PORT" \
+	-i "$INPUT_DIR" > master.out 2> master.err &
+MASTER_PID=$!
+
+# Every worker's statistics are in once the server has seen all the READYs
+READY=0
+while [ "$READY" -lt "$WORKERS" ]; do
+	if [ "$(elapsed "$START" "$(now)" | cut -d. -f1)" -ge "$TIMEOUT" ]; then
+		echo "Timed out: $READY/$WORKERS workers ready"
+		exit $ERR_START
+	elif ! kill -0 "$MASTER_PID" 2> /dev/null; then
+		echo "master exited, see $OUT/master.err"
+		exit $ERR_START
+	fi
+
+	sleep 0.05
+
+	READY=$(query /metrics | awk '$1 == "whoserver_workers_ready" { print $2 }')
+	READY=${READY:-0}
+done
+
+INGEST=$(elapsed "$START" "$(now)")
+
+# First query answered by the workers themselves (not from the cube)
+FIRST_QUERY=$(grep -m 1 "^/searchPatientRecord" "$QUERY_FILE" || head -n 1 "$QUERY_FILE")
+query "$FIRST_QUERY" > first_query.txt
+FIRST=$(elapsed "$START" "$(now)")
+
+echo "Ready after ${INGEST}s, first query after ${FIRST}s. Running whoClient -bench..."
+
+BENCH_ARGS=(-q "$QUERY_FILE" -w "$CLIENT_THREADS" -sp "$QUERY_PORT" -sip 127.0.0.1 -bench)
+[ "$COUNT" -gt 0 ] && BENCH_ARGS+=(-count "$COUNT")
+[ "$RATE" != 0 ] && BENCH_ARGS+=(-rate "$RATE")
+
+"$ROOT/whoClient" "${BENCH_ARGS[@]}" > bench.txt 2> bench.err
+query /metrics > metrics.txt
+
+teardown
+
+# Summary: throughput and latency (ms) of all the queries, from the first table
+read -r THROUGHPUT P50 P90 P99 P999 ERRORS <<< "$(awk '$1 == "all" { print $4, $5, $6, $7, $8, $3; exit }' bench.txt)"
+
+cat > summary.txt << EOF
+workers $WORKERS
+files $FILES
+records $RECORDS
+ingest_seconds $INGEST
+first_query_seconds $FIRST
+queries_per_second $THROUGHPUT
+errors $ERRORS
+latency_p50_ms $P50
+latency_p90_ms $P90
+latency_p99_ms $P99
+latency_p999_ms $P999
+EOF
+
+cat bench.txt
+echo
+cat summary.txt
+echo
+echo "Results in $OUT"
@@ -2,6 +2,7 @@
 
 import argparse
 import datetime
+import itertools
 import os
 import random
 
@@ -30,6 +31,27 @@ def make_args_parser():
                         help='Start date', metavar='')
     parser.add_argument('--endDate', default='10-01-2020',
                         help='End date', metavar='')
+    parser.add_argument('--seed', default=None, type=int,
+                        help='Random seed, for repeatable query files', metavar='')
+    parser.add_argument('--skew', default=0.0, type=float,
+                        help='Zipf exponent of country/disease popularity '
+                             '(0: uniform)', metavar='')
+    parser.add_argument('--commandWeights', default=None,
+                        help='Comma-separated weights of the commands, '
+                             'in commandsFile order', metavar='')
+    parser.add_argument('--window', default='uniform',
+                        choices=['uniform', 'fixed', 'exponential', 'recent'],
+                        help='Width of the date1-date2 windows: uniform '
+                             '(any date2 after date1), fixed (windowDays), '
+                             'exponential (mean windowDays) or recent '
+                             '(exponential, ending close to endDate)')
+    parser.add_argument('--windowDays', default=30, type=int,
+                        help='Window width (days) for fixed/exponential/recent',
+                        metavar='')
+    parser.add_argument('--rate', default=0.0, type=float,
+                        help='Prefix queries with Poisson arrival times at '
+                             'this rate (queries/second), for whoClient '
+                             '-bench -replay', metavar='')
     # return an ArgumentParser object
     return parser.parse_args()
 
@@ -53,43 +75,85 @@ def random_date(start_date, end_date):
     random_date = start_date + datetime.timedelta(days=random_number_of_days)
     return random_date.strftime('%d-%m-%Y')
 
+def zipf_weights(n, skew):
+    """
+    Popularity of the n items (in file order) under Zipf's law:
+    item i (1 to n) is picked with probability proportional to 1/i^skew.
+    """
+    return list(itertools.accumulate(1.0 / (i ** skew) for i in range(1, n + 1)))
+
+def random_window(args, start_date, end_date):
+    """
+    Return (date1, date2) strings, as per the --window distribution.
+    """
+    days = (end_date - start_date).days
+    if args.window == 'uniform':
+        date1 = random_date(start_date, end_date)
+        date1_time = datetime.datetime.strptime(date1, '%d-%m-%Y')
+        return date1, random_date(date1_time, end_date + timedelta(days=1))
+    if args.window == 'fixed':
+        width = args.windowDays
+    else:
+        width = int(random.expovariate(1.0 / max(args.windowDays, 1)))
+    width = min(width, days)
+    if args.window == 'recent':
+        # Windows end within a (mean) window width from the end date
+        offset = min(int(random.expovariate(1.0 / max(args.windowDays, 1))), days - width)
+        date2 = end_date - timedelta(days=offset)
+    else:
+        date2 = start_date + timedelta(days=random.randint(width, days))
+    date1 = date2 - timedelta(days=width)
+    return date1.strftime('%d-%m-%Y'), date2.strftime('%d-%m-%Y')
+
 def main():
     # parse and print arguments
     args = make_args_parser()
     print_args(args)
+    random.seed(args.seed)
     # Open files
     commands = open(args.commandsFile).read().splitlines()
     countries = open(args.countriesFile).read().splitlines()
     diseases = open(args.diseasesFile).read().splitlines()
+    # Popularity of commands, countries and diseases
+    if args.commandWeights:
+        weights = [float(w) for w in args.commandWeights.split(',')]
+        command_weights = list(itertools.accumulate(weights))
+    else:
+        command_weights = None
+    country_weights = zipf_weights(len(countries), args.skew)
+    disease_weights = zipf_weights(len(diseases), args.skew)
     # Initiliaze datetime objects
     start_date = datetime.datetime.strptime(args.startDate, '%d-%m-%Y')
     end_date = datetime.datetime.strptime(args.endDate, '%d-%m-%Y')
+    arrival = 0.0
     # Create queryFile
     with open(args.queryFile, "w") as query_file:
         # Generate numQueries random queries
         for i in range(args.numQueries):
-            command = random.choice(commands)
+            command = random.choices(commands, cum_weights=command_weights)[0]
+            if args.rate > 0:
+                query_file.write('%.6f ' % arrival)
+                arrival += random.expovariate(args.rate)
             for index, token in enumerate(command.split()):
                 if index > 0:
                     if token == 'disease':
-                        token = random.choice(diseases)
+                        token = random.choices(diseases, cum_weights=disease_weights)[0]
                     elif token == '[country]':
                         flip = random.randint(0, 1)
                         if flip:
-                            token = random.choice(countries)
+                            token = random.choices(countries, cum_weights=country_weights)[0]
                         else:
                             token = ''
                     elif token == 'country':
-                        token = random.choice(countries)
+                        token = random.choices(countries, cum_weights=country_weights)[0]
                     elif token == 'k':
                         token = str(random.randint(1, args.maxK))
                     elif token == 'recordID':
                         token = str(random.randint(0, args.maxRecordID))
                     elif token == 'date1':
-                        token = str(random_date(start_date, end_date))
-                        command_date1 = datetime.datetime.strptime(token, '%d-%m-%Y')
+                        token, command_date2 = random_window(args, start_date, end_date)
                     elif token == 'date2':
-                        token = str(random_date(command_date1, end_date))
+                        token = command_date2
                 query_file.write(token)
                 query_file.write(" ")
             query_file.write("\n")
@@ -0,0 +1,30 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <arpa/inet.h>
+
+/* Load generator: a fixed pool of <threads> sends the queries of the file
+ * (cycling through them, up to <count> queries) and reports throughput and
+ * latency percentiles per command.
+ * - Open loop (rate > 0): queries are due at a constant rate, or with
+ *   exponential inter-arrival times (poisson). Latency counts from when a
+ *   query was due, not when a thread got around to sending it, so a slow
+ *   server isn't hidden by fewer queries being sent (coordinated omission)
+ * - Closed loop (rate = 0): every thread sends its next query as soon as it
+ *   gets a response
+ * - Replay: every line of the file is "<seconds> <query>", and queries are
+ *   due at their (relative) time, divided by <speed>. Latency is measured as
+ *   in the open loop */
+struct bench_options {
+	double rate;                                    /* Queries/second */
+	int poisson;
+	long count;                          /* 0: every query in the file once */
+	unsigned seed;                             /* For Poisson arrivals */
+
+	int replay;
+	double speed;                           /* e.g. 2: twice as fast */
+};
+
+int bench(char *query_file, int n_threads, in_port_t server_port, in_addr_t server_ip, struct bench_options *options);
+
+#endif /* BENCH_H */
@@ -3,6 +3,11 @@
 
 #include <arpa/inet.h>
 
-int client(char *query_file, int n_threads, in_port_t server_port, in_addr_t server_ip);
+/* Optional settings */
+struct client_options {
+	int trace;                       /* Trace every query (see trace.h) */
+};
+
+int client(char *query_file, int n_threads, in_port_t server_port, in_addr_t server_ip, struct client_options *options);
 
 #endif /* CLIENT_H */
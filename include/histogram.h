@@ -0,0 +1,42 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* HDR-style (log-linear) histogram of non-negative values, e.g. latencies
+ * in microseconds. Every power of 2 is split in HIST_SUB_BUCKETS linear
+ * buckets, so any recorded value is reported within ~3% of its real value,
+ * over the whole 64-bit range, in constant space. Not thread-safe. */
+#define HIST_SUB_BITS 5
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t bucket[HIST_BUCKETS];
+};
+
+void histogram_init(struct histogram *h);
+
+void histogram_record(struct histogram *h, uint64_t value);
+
+/* dst += src */
+void histogram_merge(struct histogram *dst, const struct histogram *src);
+
+/* Value below which <quantile> (0.0 - 1.0) of the recorded values fall */
+uint64_t histogram_quantile(const struct histogram *h, double quantile);
+
+/* Prometheus text format summary: <name>{<labels>,quantile="..."} lines,
+ * then <name>_sum and <name>_count. <labels> may be empty.
+ * Returns the length of the text, like snprintf */
+int histogram_format(char *buf, size_t size, const char *name, const char *labels,
+                     const struct histogram *h);
+
+/* Monotonic clock, in microseconds */
+uint64_t histogram_clock(void);
+
+#endif /* HISTOGRAM_H */
@@ -3,8 +3,11 @@
 #ifndef HASHTABLE_H
 #define HASHTABLE_H
 
+#include "common.h"
 #include "record.h"
 
+struct p_aggregate;
+
 struct hash_table {
 	int entries;
 	void *bucket[];
@@ -15,12 +18,29 @@ struct bucket_entry {
 	struct tree_node* tree;
 };
 
+/* Work done so far (for /metrics) */
+struct ht_stats {
+	unsigned long records;                                 /* Inserted */
+	unsigned long scans;            /* Tree traversals for range queries */
+	unsigned long visited;                  /* Records visited by scans */
+};
+
 /* Interface */
 int string_hash(struct hash_table *ht, char *_str);
 
 int ht_init(int disease_entries, int country_entries, int bucket_size);
 void ht_destroy();
 
+void ht_get_stats(struct ht_stats *stats);
+
+/* Live migration (see master.h). The server excludes the countries a worker
+ * is loading, or has handed over, from its requests: query results leave
+ * them out until ht_exclude_countries(NULL, 0). <countries> must outlive
+ * the request. Dropping a country frees all of its records */
+void ht_exclude_countries(char **countries, int n);
+int ht_country_served(char *country);
+int ht_drop_country(char *country);
+
 /* Worker commands implementation */
 int insert_record(struct record *tmp);
 int file_statistics(char *country, char *file, int response_fd);
@@ -28,6 +48,7 @@ int list_countries(int response_fd);
 int topk_age_ranges(int k, char *country, char *disease, struct date *date1, struct date *date2, int response_fd);
 int num_patient_admissions(char *disease, struct date *date1, struct date *date2, char *country, int response_fd);
 int num_patient_discharges(char *disease, struct date *date1, struct date *date2, char *country, int response_fd);
+int aggregate_patients(enum mode mode, char *disease, struct date *date1, struct date *date2, char *country, struct p_aggregate *agg);
 
 struct bucket_entry *get_next_country(int reset);
 int have_date_records(struct tree_node *country, char *file);
@@ -1,6 +1,21 @@
 #ifndef MASTER_H
 #define MASTER_H
 
-int master(int workers, int buffer_size, char *server_ip, char *server_port, char *input_dir);
+/* Live migration: "migrate <country> <worker>" written to the control pipe
+ * moves a country while both workers keep serving. The target loads it
+ * (CMD_LOAD) and sends its statistics, the server switches its routing
+ * table at the READY, and the target answers "loaded <country> <worker>"
+ * on the same pipe. Then the source drops the country (CMD_DROP) */
+#define CONTROL_PIPE "/tmp/p_control"
+
+/* <assign_file>: optional, "<country> <worker>" per line. Other countries
+ * go to the least loaded worker (by bytes), biggest first.
+ * <replicas>: workers are split in as many groups, and every group holds
+ * every country once. The server spreads queries over the replicas.
+ * <standby>: every worker has a warm standby, forked and loaded in advance
+ * (statistics kept in a file). When a worker dies, its standby takes its
+ * tag (CMD_ACTIVATE), listens on a new port and re-sends the statistics:
+ * the server updates its port table from the header, as on a respawn */
+int master(int workers, int replicas, int standby, int buffer_size, char *server_ip, char *server_port, char *input_dir, char *assign_file);
 
 #endif /* MASTER_H */
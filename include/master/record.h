@@ -32,6 +32,7 @@ void records_init(int record_entries);
 
 struct record *record_get(char *record_id);
 struct record *record_add(struct record*);
+int records_drop(char *country);
 
 void records_destroy(void);
 
@@ -18,6 +18,10 @@ struct tree_node *tree_find_gte_node(struct tree_node *root, struct date *entry_
  * Afterwards, pass NULL. It works like strtok in this regard. */
 struct record *tree_get_next_record(struct tree_node *root);
 
+/* Like tree_get_next_record(root), but starts from the first record with
+ * entry date >= entry_date (NULL if none). Continue with NULL as above */
+struct record *tree_seek(struct tree_node *root, struct date *entry_date);
+
 void tree_destroy(struct tree_node *root);
 
 #endif /* TREE_H */
@@ -1,6 +1,8 @@
 #ifndef WORKER_H
 #define WORKER_H
 
-int worker(int tag, char *input_dir);
+/* <standby>: load the countries, then wait for the master to activate it
+ * in place of a dead worker <tag> (see master.h) */
+int worker(int tag, char *input_dir, int standby);
 
 #endif /* WORKER_H */
@@ -2,8 +2,12 @@
 #define PIPES_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 #define CMD_DIRECTORIES "/directories"
+#define CMD_LOAD "/load"                          /* Master to worker */
+#define CMD_DROP "/drop"
+#define CMD_ACTIVATE "/activate"
 #define CMD_LIST_COUNTRIES "/listCountries"
 #define CMD_DISEASE_FREQUENCY "/diseaseFrequency"
 #define CMD_TOPK_AGE_RANGES "/topk-AgeRanges"
@@ -11,6 +15,16 @@
 #define CMD_NUM_ADMISSIONS "/numPatientAdmissions"
 #define	CMD_NUM_DISCHARGES "/numPatientDischarges"
 #define CMD_EXIT "/exit"
+#define CMD_METRICS "/metrics"
+
+/* Aggregate-only mode: <CMD_AGGREGATE>, then a command and its arguments.
+ * Worker answers with a struct p_aggregate instead of text */
+#define CMD_AGGREGATE "/aggregate"
+
+/* Header of a (server) request: <MSG_EXCLUDE>, a count and as many
+ * countries, for the worker to leave out of its response (see route.h) */
+#define MSG_EXCLUDE "@exclude"
+#define EXCLUDE_MAX 512
 
 #define MSG_DELIMITER "\n"
 #define MSG_DONE ""
@@ -25,6 +39,14 @@ struct p_msg {
 	int consumed;
 };
 
+/* Typed partial result of an aggregate-only query.
+ * Sent in network byte order, followed by MSG_READY */
+struct p_aggregate {
+	int32_t status;                       /* DA_OK or the worker's error */
+	uint32_t count;
+	uint32_t age_group[4];                        /* 0-20, 21-40, 41-60, 60+ */
+};
+
 void msg_init(struct p_msg *msg);
 
 void pipes_init(int _buffer_size);
@@ -39,4 +61,9 @@ int msg_done(int fd);
 int msg_ready(int fd);
 int msg_invalid(int fd);
 
+int msg_write_aggregate(int fd, struct p_aggregate *agg);
+
+/* In place, network to host byte order */
+void msg_decode_aggregate(struct p_aggregate *agg);
+
 #endif /* PIPES_H */
@@ -0,0 +1,26 @@
+#ifndef CUBE_H
+#define CUBE_H
+
+/* Materialized cube of the statistics streamed by the workers:
+ * day x country x disease x age group, with prefix sums over the days.
+ * Answers admission counts without contacting the workers. */
+
+void cube_init(void);
+void cube_destroy(void);
+
+/* Statistics stream of worker <tag> started (header) / finished (READY) */
+void cube_worker_begin(int tag);
+void cube_worker_ready(int tag);
+
+/* One message (one file) of the statistics stream. Re-sent files
+ * (e.g. from a respawned worker) replace the previous counts */
+int cube_add_statistics(int tag, char *msg);
+
+/* "DD-MM-YYYY" to YYYYMMDD, -1 if it is not a valid date (see valid_date) */
+int cube_day(const char *str);
+
+/* Admissions for <disease> in [day1, day2], for <country> or all countries.
+ * Returns DA_OK, or an error if the cube can't answer (yet) */
+int cube_admissions(char *disease, char *country, int day1, int day2, long *count, long *age_group);
+
+#endif /* CUBE_H */
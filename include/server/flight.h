@@ -0,0 +1,28 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <stddef.h>
+
+/* Single-flight coalescing of identical, concurrent queries.
+ * The first thread to join a flight (the leader) executes the query and
+ * lands it with the response. Threads joining while the flight is pending
+ * wait for the landing and reuse the leader's response. */
+struct flight;
+
+/* Normalize query: tokens separated by a single space */
+void flight_key(char *key, size_t size, const char *query);
+
+/* *leader is set to 1 if the caller must execute the query, 0 otherwise */
+struct flight *flight_join(const char *key, int *leader);
+
+/* Leader: publish response and return value, wake up the waiting threads.
+ * A NULL response makes the followers run the query on their own */
+void flight_land(struct flight *flight, const char *response, size_t len, int ret);
+
+/* Follower: block until the flight lands. Returns the leader's ret */
+int flight_wait(struct flight *flight, const char **response, size_t *len);
+
+/* Both: drop reference. The last one out frees the flight */
+void flight_leave(struct flight *flight);
+
+#endif /* FLIGHT_H */
@@ -0,0 +1,29 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stddef.h>
+
+/* Asynchronous logging to stdout.
+ * Every thread logs to its own lock-free ring (single producer, single
+ * consumer), which a dedicated writer thread drains. When a ring is full,
+ * the line is dropped (and counted), instead of blocking the thread. */
+
+/* <rings> threads may log, each with <ring_size> bytes of space.
+ * Only 1 out of every <sampling> queries is logged */
+int log_init(int rings, size_t ring_size, int sampling);
+
+/* Flush everything and stop the writer thread */
+void log_destroy(void);
+
+/* Calling thread gets a ring of its own */
+int log_attach(void);
+
+/* Should the current query be logged? */
+int log_sample(void);
+
+int log_write(const char *buf, size_t nbyte);
+
+/* Lines dropped so far */
+unsigned long log_dropped(void);
+
+#endif /* LOG_H */
@@ -0,0 +1,40 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#include "server/reply.h"
+
+/* Server-side metrics, reported (with the workers' own) by /metrics.
+ * Latencies in microseconds (histogram_clock). Thread-safe */
+
+enum metrics_source {SOURCE_WORKERS, SOURCE_CUBE, SOURCE_COALESCED, SOURCES};
+
+enum metrics_port {PORT_STATISTICS, PORT_QUERY, PORTS};
+
+void metrics_init(void);
+void metrics_destroy(void);
+
+/* Accepted connection / query thread busy (+1) or done (-1) */
+void metrics_accept(enum metrics_port port);
+void metrics_active(int delta);
+
+/* Ring buffer: depth after a push, time an fd waited there until popped */
+void metrics_queue_push(int depth);
+void metrics_queue_pop(int depth, uint64_t wait);
+
+/* Client query <cmd>, answered by <source> in <latency> */
+void metrics_query(const char *cmd, enum metrics_source source, int ret, uint64_t latency);
+
+/* Worker <tag>: statistics done (READY) */
+void metrics_worker_ready(int tag);
+
+/* Worker <tag>: response complete, timed out, connect() failed */
+void metrics_worker_rtt(int tag, uint64_t rtt);
+void metrics_worker_timeout(int tag);
+void metrics_worker_error(int tag);
+
+/* Prometheus text format */
+int metrics_report(struct reply *reply);
+
+#endif /* METRICS_H */
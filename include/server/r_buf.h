@@ -1,3 +1,4 @@
+#include <stdint.h>
 #include <stdlib.h>
 
 /* Circular (ring) buffer implementation
@@ -8,9 +9,11 @@ struct ring_buffer *make_r_buf(size_t capacity);
 
 int r_buf_full(struct ring_buffer *r_buf);
 int r_buf_empty(struct ring_buffer *r_buf);
+size_t r_buf_count(struct ring_buffer *r_buf);
 
-void r_buf_push(struct ring_buffer *r_buf, int data);
-int r_buf_pop(struct ring_buffer *r_buf);
+/* Every item carries a stamp (e.g. enqueue time). stamp may be NULL in pop */
+void r_buf_push(struct ring_buffer *r_buf, int data, uint64_t stamp);
+int r_buf_pop(struct ring_buffer *r_buf, uint64_t *stamp);
 int r_buf_peek(struct ring_buffer *r_buf);
 
 void r_buf_destroy(struct ring_buffer *r_buf);
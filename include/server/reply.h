@@ -0,0 +1,39 @@
+#ifndef REPLY_H
+#define REPLY_H
+
+#include <stddef.h>
+
+/* Responses bigger than this are not shared with coalesced queries */
+#define REPLY_CAPTURE_MAX (1 << 20)
+
+/* Response to a client query. Data is written straight to the client and,
+ * on the side:
+ * - captured (whole) for the queries coalesced with this one
+ * - logged, up to the size of the log buffer (if any) */
+struct reply {
+	int client_fd;
+
+	char *capture;
+	size_t len;
+	size_t size;
+	int overflow;                         /* Capture exceeded the limit */
+
+	char *log;
+	size_t log_len;
+	size_t log_size;
+	int truncated;
+};
+
+void reply_init(struct reply *reply, int client_fd, int capture, char *log, size_t log_size);
+
+int reply_write(struct reply *reply, const char *buf, size_t nbyte);
+
+/* Formatted, for the server's own (short) answers */
+int reply_printf(struct reply *reply, const char *format, ...);
+
+/* Log only (e.g. query headers) */
+void reply_log(struct reply *reply, const char *buf, size_t nbyte);
+
+void reply_destroy(struct reply *reply);
+
+#endif /* REPLY_H */
@@ -0,0 +1,49 @@
+#ifndef ROUTE_H
+#define ROUTE_H
+
+#include <stddef.h>
+
+/* Routing table: the workers holding each country (its replicas), from
+ * the statistics streams, and the state of every worker: ready (READY
+ * received since it (re)started), down (unreachable until its next READY)
+ * and its requests in flight.
+ * A replica moving to another worker (live migration, see the master) is
+ * pending until the new holder's READY, when the table flips: from then on
+ * the previous holder is stale for it. Fan-out queries use one replica per
+ * country, and tell the workers they contact to leave out the countries
+ * answered elsewhere, so that no country is counted twice, nor missed. */
+
+void route_init(void);
+void route_destroy(void);
+
+/* Statistics stream of worker <tag> started: it's not ready, and whatever
+ * it was loading before (e.g. it died and got respawned) isn't coming */
+void route_begin(int tag);
+
+/* Statistics of worker <tag> include <country> (<len> bytes) */
+void route_hold(int tag, const char *country, size_t len);
+
+/* Migration: worker <tag> is loading <country>, to take over from <from> */
+void route_move(int tag, const char *country, int from);
+
+/* READY from worker <tag>: it's ready, and the countries pending for it are
+ * its own now. Returns how many */
+int route_commit(int tag);
+
+/* Worker <tag> could not be reached: replicas elsewhere answer for it */
+void route_down(int tag);
+
+/* Requests in flight to worker <tag>: +1 when sent, -1 when answered */
+void route_load(int tag, int delta);
+
+/* Per-country query: the ready replica with the fewest requests in flight.
+ * -1 if the country is unknown */
+int route_pick(const char *country);
+
+/* Fan-out query, to workers [0, <workers>): one replica per country, taking
+ * turns among them. Sets <contact>[w] for the workers needed. The countries
+ * they must leave out go in <excluded> + w * <size>, as lines, and their
+ * count in <n>[w]. Returns DA_OK, or an error if a list doesn't fit */
+int route_fanout(int workers, int *contact, char *excluded, size_t size, int *n);
+
+#endif /* ROUTE_H */
@@ -3,6 +3,13 @@
 
 #include <arpa/inet.h>
 
-int server(in_port_t query_port, in_port_t statistics_port, int n_threads, int buffer_size);
+/* Optional settings */
+struct server_options {
+	int verbosity;      /* 0: nothing, 1: queries, 2: queries and results */
+	int sampling;                      /* Log 1 out of <sampling> queries */
+	int slow_ms;          /* Log the spans of queries slower than this */
+};
+
+int server(in_port_t query_port, in_port_t statistics_port, int n_threads, int buffer_size, struct server_options *options);
 
 #endif /* SERVER_H */
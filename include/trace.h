@@ -0,0 +1,54 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Query tracing across client, server and workers.
+ * A traced query carries an id in a header, before the command:
+ * - client -> server: "@trace <id> <cmd> <args>"
+ * - server -> worker: "@trace\n<id>\n<cmd>\n<args>..."
+ * Every process times its part of the query in spans, and appends them to
+ * traces/<process>.<pid>, one line per span:
+ *   <id> <process> <pid> <span> <start> <end> [<detail>]
+ * with wall-clock (CLOCK_REALTIME) microseconds, comparable across processes.
+ * See trace_timeline.py for putting the pieces together. */
+
+#define TRACE_HEADER "@trace"
+#define TRACE_DIR "traces"
+
+#define TRACE_ID_SIZE 32
+#define TRACE_SPANS 32
+
+struct trace_span {
+	const char *name;
+	int index;                       /* e.g. worker tag, -1 if none */
+	uint64_t start;
+	uint64_t end;
+};
+
+struct trace {
+	char id[TRACE_ID_SIZE];                  /* Empty: not traced */
+	int spans;
+	struct trace_span span[TRACE_SPANS];
+};
+
+/* Wall clock, in microseconds */
+uint64_t trace_clock(void);
+
+void trace_init(struct trace *trace, const char *id);
+
+/* Spans beyond TRACE_SPANS are dropped */
+void trace_span(struct trace *trace, const char *name, int index, uint64_t start, uint64_t end);
+
+/* If <query> starts with a trace header, copy the id to <id> and return the
+ * query after it. Otherwise, <id> is empty and <query> is returned as is */
+char *trace_header(char *query, char *id);
+
+/* Append spans to traces/<process>.<pid> (no-op if not traced) */
+int trace_write(const struct trace *trace, const char *process, const char *detail);
+
+/* One-line summary, "<span>=<duration>us ...", like snprintf */
+int trace_format(const struct trace *trace, char *buf, size_t size);
+
+#endif /* TRACE_H */
@@ -0,0 +1,283 @@
+/* Microbenchmarks of the worker data structures (see "make bench").
+ * Every result is a JSON object on a line of its own (JSON Lines) */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "histogram.h"
+#include "master/hashtable.h"
+#include "master/record.h"
+#include "master/tree.h"
+#include "pipes.h"
+
+#define DAYS (20 * 12 * 30)             /* Dates span 20 years (of 360 days) */
+#define WINDOW 90                                  /* Range scans, in days */
+
+static char *_countries[] = {
+	"Greece", "Italy", "Spain", "France", "Germany",
+	"Finland", "Denmark", "Chile", "Iraq", "Malawi"
+};
+
+static char *_diseases[] = {
+	"COVID-2019", "H1N1", "SARS-1", "EVD", "MERS-COV",
+	"FLU-2018", "EBOLA", "ZIKA", "CHOLERA", "MEASLES"
+};
+
+#define COUNTRIES (sizeof(_countries)/sizeof(_countries[0]))
+#define DISEASES (sizeof(_diseases)/sizeof(_diseases[0]))
+
+/* Generated dataset: record i enters on day[i] (ascending if sorted) */
+struct dataset {
+	int n;
+	const char *order;
+	int *day;
+	int *country;
+	int *disease;
+	int *age;
+};
+
+static unsigned seed = 1;
+
+/* Day number to date, with 30-day months: order is all that matters */
+static struct date day_date(int day)
+{
+	char str[32];
+
+	snprintf(str, sizeof(str), "%02d-%02d-%04d",
+	         day % 30 + 1, day / 30 % 12 + 1, 2000 + day / 360);
+
+	return to_date(str);
+}
+
+static void dataset_make(struct dataset *data, int n, int sorted)
+{
+	int i;
+
+	data->n = n;
+	data->order = sorted ? "sorted" : "random";
+
+	data->day = malloc(n * sizeof(data->day[0]));
+	data->country = malloc(n * sizeof(data->country[0]));
+	data->disease = malloc(n * sizeof(data->disease[0]));
+	data->age = malloc(n * sizeof(data->age[0]));
+
+	for (i = 0; i < n; ++i) {
+		/* Sorted: like the worker, reading the files in date order */
+		data->day[i] = sorted ? (long) i * DAYS / n : rand_r(&seed) % DAYS;
+		data->country[i] = rand_r(&seed) % COUNTRIES;
+		data->disease[i] = rand_r(&seed) % DISEASES;
+		data->age[i] = rand_r(&seed) % 121;
+	}
+}
+
+static void dataset_free(struct dataset *data)
+{
+	free(data->day);
+	free(data->country);
+	free(data->disease);
+	free(data->age);
+}
+
+/* A line of output */
+static void report(const char *bench, struct dataset *data, long ops, uint64_t us, const char *extra)
+{
+	double seconds = us / 1e6;
+
+	printf("{\"bench\": \"%s\", \"order\": \"%s\", \"n\": %d, \"ops\": %ld, "
+	       "\"seconds\": %.6f, \"ops_per_sec\": %.1f, \"ns_per_op\": %.1f%s%s}\n",
+	       bench, data->order, data->n, ops, seconds,
+	       seconds > 0 ? ops / seconds : 0.0,
+	       ops ? us * 1000.0 / ops : 0.0,
+	       *extra ? ", " : "", extra);
+
+	fflush(stdout);
+}
+
+/* Worker path: insert_record (records hash table, country & disease trees) */
+static void bench_insert(struct dataset *data)
+{
+	char record_id[FIELD_SIZE], first_name[] = "John", last_name[] = "Doe";
+	struct record tmp;
+	uint64_t start;
+	int i;
+
+	start = histogram_clock();
+
+	for (i = 0; i < data->n; ++i) {
+		snprintf(record_id, sizeof(record_id), "%d", i);
+
+		memset(&tmp, 0, sizeof(tmp));
+		tmp.record_id = record_id;
+		tmp.first_name = first_name;
+		tmp.last_name = last_name;
+		tmp.disease_id = _diseases[data->disease[i]];
+		tmp.country = _countries[data->country[i]];
+		tmp.age = data->age[i];
+		tmp.entry_date = day_date(data->day[i]);
+
+		insert_record(&tmp);
+	}
+
+	report("insert_record", data, data->n, histogram_clock() - start, "");
+}
+
+static void bench_record_get(struct dataset *data, int lookups)
+{
+	char record_id[FIELD_SIZE];
+	uint64_t start;
+	long found = 0;
+	int i;
+
+	start = histogram_clock();
+
+	for (i = 0; i < lookups; ++i) {
+		/* Half of them miss */
+		snprintf(record_id, sizeof(record_id), "%d", rand_r(&seed) % (2 * data->n));
+
+		if (record_get(record_id))
+			found++;
+	}
+
+	report("record_get", data, lookups, histogram_clock() - start, "");
+
+	if (!found)
+		fputs("record_get: no records found\n", stderr);
+}
+
+/* Admissions in a window, by the worker code and by brute force */
+static void bench_range_scan(struct dataset *data, int scans)
+{
+	struct p_aggregate agg;
+	struct ht_stats before, after;
+	struct date date1, date2;
+	int i, r, day1, disease, country;
+	long expected, mismatches = 0;
+	uint64_t start, us = 0;
+	char extra[128];
+
+	ht_get_stats(&before);
+
+	for (i = 0; i < scans; ++i) {
+		day1 = rand_r(&seed) % (DAYS - WINDOW);
+		disease = rand_r(&seed) % DISEASES;
+		country = rand_r(&seed) % COUNTRIES;
+
+		date1 = day_date(day1);
+		date2 = day_date(day1 + WINDOW);
+
+		start = histogram_clock();
+		aggregate_patients(ENTER, _diseases[disease], &date1, &date2,
+		                   _countries[country], &agg);
+		us += histogram_clock() - start;
+
+		for (r = 0, expected = 0; r < data->n; ++r) {
+			if (data->country[r] == country && data->disease[r] == disease &&
+			    data->day[r] >= day1 && data->day[r] <= day1 + WINDOW)
+				expected++;
+		}
+
+		if (agg.count != expected)
+			mismatches++;
+	}
+
+	ht_get_stats(&after);
+
+	snprintf(extra, sizeof(extra), "\"window_days\": %d, \"visited_per_op\": %.1f, \"mismatches\": %ld",
+	         WINDOW, (double) (after.visited - before.visited) / scans, mismatches);
+
+	report("range_scan", data, scans, us, extra);
+}
+
+/* The tree on its own: build one of all the records, then seek in it */
+static void bench_tree(struct dataset *data, int seeks)
+{
+	struct record *records = calloc(data->n, sizeof(records[0]));
+	struct tree_node *root = NULL;
+	struct date date;
+	uint64_t start;
+	int i;
+
+	for (i = 0; i < data->n; ++i)
+		records[i].entry_date = day_date(data->day[i]);
+
+	start = histogram_clock();
+
+	for (i = 0; i < data->n; ++i)
+		root = tree_insert(root, records + i);
+
+	report("tree_insert", data, data->n, histogram_clock() - start, "");
+
+	start = histogram_clock();
+
+	for (i = 0; i < seeks; ++i) {
+		date = day_date(rand_r(&seed) % DAYS);
+		tree_find_gte_node(root, &date);
+	}
+
+	report("tree_find_gte_node", data, seeks, histogram_clock() - start, "");
+
+	tree_destroy(root);
+	free(records);
+}
+
+static int print_usage(const char *program)
+{
+	fprintf(stderr, "%s [-n size,size,...] [-q queries] [-s seed]\n", program);
+	return DA_INVALID_PARAMETER;
+}
+
+int main(int argc, char *argv[])
+{
+	char default_sizes[] = "1000,4000,16000";
+	char *sizes = default_sizes, *size;
+	struct dataset data;
+	int opt, n, sorted;
+	int queries = 10000;
+
+	while ((opt = getopt(argc, argv, "n:q:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			sizes = optarg;
+			break;
+
+		case 'q':
+			queries = atoi(optarg);
+			break;
+
+		case 's':
+			seed = atoi(optarg);
+			break;
+
+		default:
+			return print_usage(argv[0]);
+		}
+	}
+
+	if (queries <= 0)
+		return print_usage(argv[0]);
+
+	for (size = strtok(sizes, ","); size; size = strtok(NULL, ",")) {
+		if ((n = atoi(size)) <= 0)
+			return print_usage(argv[0]);
+
+		for (sorted = 1; sorted >= 0; --sorted) {
+			dataset_make(&data, n, sorted);
+
+			/* Same setup as the workers */
+			ht_init(13, 13, 512);
+
+			bench_insert(&data);
+			bench_record_get(&data, queries);
+			bench_range_scan(&data, queries / 10);
+			bench_tree(&data, queries);
+
+			ht_destroy();
+			dataset_free(&data);
+		}
+	}
+
+	return DA_OK;
+}
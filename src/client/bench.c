@@ -0,0 +1,393 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "client/bench.h"
+#include "common.h"
+#include "histogram.h"
+#include "pipes.h"
+
+static const char *_commands[] = {
+	CMD_DISEASE_FREQUENCY, CMD_TOPK_AGE_RANGES, CMD_SEARCH_RECORD,
+	CMD_NUM_ADMISSIONS, CMD_NUM_DISCHARGES, "other"
+};
+
+#define COMMANDS (sizeof(_commands)/sizeof(_commands[0]))
+
+static const char _cmd_err[] = "Error in request.";
+
+/* Per thread, merged at the end */
+struct bench_thread {
+	pthread_t thread;
+	struct histogram latency[COMMANDS];     /* From when the query was due */
+	struct histogram service[COMMANDS];        /* From when it was sent */
+	long errors[COMMANDS];
+};
+
+/* Thread-shared variables */
+static struct sockaddr_in to_server;
+
+static char **queries;
+static int *commands;                     /* Index in _commands, per query */
+static double *times;                         /* Replay: seconds, per query */
+static long n_queries;
+
+static long count;                                   /* Queries to send */
+static uint64_t *due;          /* Offset from start, NULL for closed loop */
+static uint64_t start;
+static atomic_long next;
+
+/* Thread function */
+void *bench_thread(void *arg);
+
+int bench_load(char *query_file, int replay);
+int bench_schedule(struct bench_options *options);
+void bench_report(struct bench_thread *threads, int n_threads, uint64_t elapsed, struct bench_options *options);
+
+int bench(char *query_file, int n_threads, in_port_t server_port, in_addr_t server_ip, struct bench_options *options)
+{
+	struct bench_thread *threads;
+	uint64_t elapsed;
+	long i;
+	int t, c;
+
+	int ret = DA_OK;
+
+	to_server.sin_family = AF_INET;
+	to_server.sin_addr.s_addr = server_ip;
+	to_server.sin_port = server_port;
+
+	pipes_init(sizeof(((struct p_msg*) 0)->buffer)/4);
+
+	if ((ret = bench_load(query_file, options->replay)) != DA_OK)
+		return ret;
+
+	count = options->count > 0 ? options->count : n_queries;
+
+	if (options->replay)
+		count = MIN(count, n_queries);          /* Each query, once */
+
+	if ((ret = bench_schedule(options)) != DA_OK)
+		return ret;
+
+	if (!(threads = malloc(n_threads * sizeof(threads[0])))) {
+		perror("bench: malloc()");
+		return DA_ALLOCATION_ERROR;
+	}
+
+	for (t = 0; t < n_threads; ++t) {
+		for (c = 0; c < COMMANDS; ++c) {
+			histogram_init(threads[t].latency + c);
+			histogram_init(threads[t].service + c);
+			threads[t].errors[c] = 0;
+		}
+	}
+
+	atomic_init(&next, 0);
+	start = histogram_clock();
+
+	for (t = 0; t < n_threads; ++t)
+		pthread_create(&threads[t].thread, NULL, bench_thread, threads + t);
+
+	for (t = 0; t < n_threads; ++t)
+		pthread_join(threads[t].thread, NULL);
+
+	elapsed = histogram_clock() - start;
+
+	bench_report(threads, n_threads, elapsed, options);
+
+	for (i = 0; i < n_queries; ++i)
+		free(queries[i]);
+
+	free(queries);
+	free(commands);
+	free(times);
+	free(due);
+	free(threads);
+	free(query_file);
+
+	return ret;
+}
+
+/* All the (non-empty) queries of the file, in memory.
+ * Replay: queries are preceded by their time */
+int bench_load(char *query_file, int replay)
+{
+	FILE *file;
+	char line[1024], cmd[32], *query;
+	double time = 0.0;
+	size_t len, size = 0;
+	void *tmp;
+	int c;
+
+	if (!(file = fopen(query_file, "r"))) {
+		perror(query_file);
+		return DA_FILE_ERROR;
+	}
+
+	while (fgets(line, sizeof(line), file)) {
+		len = strcspn(line, "\n");
+		line[len] = '\0';
+
+		query = line;
+
+		if (replay) {
+			time = strtod(line, &query);
+
+			if (query == line) {
+				fprintf(stderr, "%s: no time: %s\n", query_file, line);
+				continue;
+			}
+
+			query += strspn(query, " \t");
+		}
+
+		if (sscanf(query, "%31s", cmd) != 1)
+			continue;
+
+		if (n_queries == size) {
+			size = size ? 2 * size : 1024;
+
+			if (!(tmp = realloc(queries, size * sizeof(queries[0])))) {
+				fclose(file);
+				return DA_ALLOCATION_ERROR;
+			}
+
+			queries = tmp;
+
+			if (!(tmp = realloc(commands, size * sizeof(commands[0])))) {
+				fclose(file);
+				return DA_ALLOCATION_ERROR;
+			}
+
+			commands = tmp;
+
+			if (!(tmp = realloc(times, size * sizeof(times[0])))) {
+				fclose(file);
+				return DA_ALLOCATION_ERROR;
+			}
+
+			times = tmp;
+		}
+
+		/* Last one ("other") catches unknown commands */
+		for (c = 0; c < COMMANDS - 1 && strcmp(cmd, _commands[c]); ++c)
+			continue;
+
+		commands[n_queries] = c;
+		times[n_queries] = time;
+
+		if (!(queries[n_queries++] = strdup(query))) {
+			fclose(file);
+			return DA_ALLOCATION_ERROR;
+		}
+	}
+
+	fclose(file);
+
+	if (!n_queries) {
+		fprintf(stderr, "%s: no queries\n", query_file);
+		return DA_FILE_ERROR;
+	}
+
+	return DA_OK;
+}
+
+/* Open loop: when every query is due. Constant intervals, or exponential
+ * (Poisson arrivals), from a fixed seed so that runs are repeatable.
+ * Replay: as logged, relative to the first query */
+int bench_schedule(struct bench_options *options)
+{
+	double at = 0.0, interval;
+	unsigned seed = options->seed;
+	long i;
+
+	if (options->rate <= 0 && !options->replay)
+		return DA_OK;
+
+	if (!(due = malloc(count * sizeof(due[0]))))
+		return DA_ALLOCATION_ERROR;
+
+	if (options->replay) {
+		for (i = 0; i < count; ++i) {
+			at = (times[i] - times[0]) * 1e6 / options->speed;
+			due[i] = at > 0 ? at : 0;
+		}
+
+		return DA_OK;
+	}
+
+	interval = 1e6 / options->rate;
+
+	for (i = 0; i < count; ++i) {
+		due[i] = at;
+
+		if (options->poisson)
+			at -= interval * log(1.0 - rand_r(&seed) / (RAND_MAX + 1.0));
+		else
+			at += interval;
+	}
+
+	return DA_OK;
+}
+
+/* Send <query>, read the whole response (and throw it away) */
+static int bench_query(const char *query)
+{
+	char response[sizeof(((struct p_msg*) 0)->buffer)];
+	size_t got = 0;
+	ssize_t n_read;
+	int sock;
+
+	int ret = DA_OK;
+
+	if ((sock = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		return DA_SOCK_ERROR;
+
+	if (connect(sock, (struct sockaddr*) &to_server, sizeof(to_server)) == -1) {
+		close(sock);
+		return DA_SOCK_ERROR;
+	}
+
+	msg_write(sock, (char*) query, strlen(query) + 1);
+
+	/* Server closes the connection once done */
+	while ((n_read = read(sock, response + MIN(got, sizeof(_cmd_err)),
+	                      sizeof(response) - sizeof(_cmd_err))) != 0) {
+		if (n_read == -1) {
+			if (errno == EINTR)
+				continue;
+
+			ret = DA_SOCK_ERROR;
+			break;
+		}
+
+		got += n_read;
+	}
+
+	close(sock);
+
+	/* Only the beginning of the response is kept: enough to spot errors */
+	if (ret == DA_OK && got >= strlen(_cmd_err) &&
+	    !strncmp(response, _cmd_err, strlen(_cmd_err)))
+		ret = DA_INVALID_PARAMETER;
+
+	return ret;
+}
+
+static void sleep_until(uint64_t us)
+{
+	struct timespec wake = {us / 1000000, (us % 1000000) * 1000};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR)
+		continue;
+}
+
+void *bench_thread(void *arg)
+{
+	struct bench_thread *thread = arg;
+	uint64_t sent, end, due_at;
+	long i;
+	int c;
+
+	while ((i = atomic_fetch_add(&next, 1)) < count) {
+		/* Open loop: wait until it's due (unless we're late already).
+		 * Closed loop: it's due when we send it */
+		if (due)
+			sleep_until(start + due[i]);
+
+		sent = histogram_clock();
+		due_at = due ? start + due[i] : sent;
+
+		c = commands[i % n_queries];
+
+		if (bench_query(queries[i % n_queries]) != DA_OK)
+			thread->errors[c]++;
+
+		end = histogram_clock();
+
+		histogram_record(thread->latency + c, end - due_at);
+		histogram_record(thread->service + c, end - sent);
+	}
+
+	return NULL;
+}
+
+static void bench_print(const char *name, struct histogram *h, long errors, uint64_t elapsed)
+{
+	printf("%-24s %8lu %7ld %9.1f %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+	       name, (unsigned long) h->count, errors, h->count * 1e6 / elapsed,
+	       histogram_quantile(h, 0.5) / 1000.0,
+	       histogram_quantile(h, 0.9) / 1000.0,
+	       histogram_quantile(h, 0.99) / 1000.0,
+	       histogram_quantile(h, 0.999) / 1000.0,
+	       h->max / 1000.0);
+}
+
+static void bench_table(const char *title, struct histogram *h, long *errors, uint64_t elapsed)
+{
+	struct histogram all;
+	long all_errors = 0;
+	int c;
+
+	histogram_init(&all);
+
+	printf("\n%s\n%-24s %8s %7s %9s %9s %9s %9s %9s %9s\n", title,
+	       "command", "count", "errors", "qps", "p50 ms", "p90 ms", "p99 ms", "p999 ms", "max ms");
+
+	for (c = 0; c < COMMANDS; ++c) {
+		if (!h[c].count)
+			continue;
+
+		bench_print(_commands[c], h + c, errors[c], elapsed);
+
+		histogram_merge(&all, h + c);
+		all_errors += errors[c];
+	}
+
+	bench_print("all", &all, all_errors, elapsed);
+}
+
+void bench_report(struct bench_thread *threads, int n_threads, uint64_t elapsed, struct bench_options *options)
+{
+	struct histogram latency[COMMANDS], service[COMMANDS];
+	long errors[COMMANDS] = {0};
+	int t, c;
+
+	for (c = 0; c < COMMANDS; ++c) {
+		histogram_init(latency + c);
+		histogram_init(service + c);
+
+		for (t = 0; t < n_threads; ++t) {
+			histogram_merge(latency + c, threads[t].latency + c);
+			histogram_merge(service + c, threads[t].service + c);
+			errors[c] += threads[t].errors[c];
+		}
+	}
+
+	if (options->replay)
+		printf("replay: %.2fx speed, %d threads\n", options->speed, n_threads);
+	else if (options->rate > 0)
+		printf("open loop: %s arrivals at %.1f queries/s, %d threads\n",
+		       options->poisson ? "poisson" : "constant", options->rate, n_threads);
+	else
+		printf("closed loop: %d threads\n", n_threads);
+
+	printf("%ld queries in %.3f s: %.1f queries/s\n",
+	       count, elapsed / 1e6, count * 1e6 / elapsed);
+
+	if (due) {
+		bench_table("latency (from when the query was due)", latency, errors, elapsed);
+		bench_table("service time (from when the query was sent)", service, errors, elapsed);
+	} else {
+		bench_table("latency", latency, errors, elapsed);
+	}
+}
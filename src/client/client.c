@@ -1,5 +1,6 @@
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,15 +10,18 @@
 #include "client/client.h"
 #include "common.h"
 #include "pipes.h"
+#include "trace.h"
 
 /* Thread-shared variables */
 static struct sockaddr_in to_server;
 static pthread_barrier_t barrier;
+static struct client_options *options;
+static atomic_uint queries;                      /* For unique trace ids */
 
 /* Thread function */
 void *send_cmd(void *arg);
 
-int client(char *query_file, int n_threads, in_port_t server_port, in_addr_t server_ip)
+int client(char *query_file, int n_threads, in_port_t server_port, in_addr_t server_ip, struct client_options *_options)
 {
 	FILE *file;
 	char *line = NULL;
@@ -27,6 +31,8 @@ int client(char *query_file, int n_threads, in_port_t server_port, in_addr_t ser
 	pthread_t threads[n_threads];
 	char cmd[n_threads][1024];
 
+	options = _options;
+
 	to_server.sin_family = AF_INET;
 	to_server.sin_addr.s_addr = server_ip;
 	to_server.sin_port = server_port;
@@ -71,6 +77,11 @@ void *send_cmd(void *arg)
 	int sock;
 	struct p_msg result;
 
+	char query[sizeof(result.buffer)];
+	struct trace trace;
+	char trace_id[TRACE_ID_SIZE];
+	uint64_t start;
+
 	/* Will block until all n_threads are up */
 	pthread_barrier_wait(&barrier);
 
@@ -80,6 +91,20 @@ void *send_cmd(void *arg)
 	cmd_len = strlen(cmd);
 	cmd[cmd_len - 1] = '\0';                       /* Replace trailing \n */
 
+	/* Traced: id is <pid>-<query number> */
+	if (options->trace) {
+		snprintf(trace_id, sizeof(trace_id), "%x-%x", (unsigned) getpid(),
+		         atomic_fetch_add(&queries, 1));
+		cmd_len = snprintf(query, sizeof(query), TRACE_HEADER " %s %s", trace_id, cmd);
+		cmd_len = MIN(cmd_len, sizeof(query) - 1);
+	} else {
+		trace_id[0] = '\0';
+		cmd_len = snprintf(query, sizeof(query), "%s", cmd);
+	}
+
+	trace_init(&trace, trace_id);
+	start = trace_clock();
+
 	if ((sock = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
 		perror("thread: socket()");
 		return (void*) DA_SOCK_ERROR;
@@ -90,13 +115,16 @@ void *send_cmd(void *arg)
 		return (void*) DA_SOCK_ERROR;
 	}
 
-	msg_write(sock, cmd, cmd_len + 1);            /* Send query to server */
+	msg_write(sock, query, cmd_len + 1);          /* Send query to server */
 
 	msg_init(&result);
 	msg_read(sock, &result);              /* Receive response from server */
 
 	close(sock);                             /* Don't need server anymore */
 
+	trace_span(&trace, "client", -1, start, trace_clock());
+	trace_write(&trace, "client", cmd);
+
 	/* Write results to stdout (printf guarantees thread-safety) */
 	printf("[%lu] %s\n%s\n", pthread_self(), cmd, result.buffer);
 
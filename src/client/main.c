@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "client/bench.h"
 #include "client/client.h"
 #include "common.h"
 
@@ -14,15 +15,25 @@ int print_usage(const char *program);
 int main(int argc, char *argv[])
 {
 	/* Parameters & relevant checking */
-	struct option long_options[3] = {
+	struct option long_options[] = {
 		{"sp", required_argument, NULL, 'p'},
 		{"sip", required_argument, NULL, 's'},
+		{"bench", no_argument, NULL, 'B'},
+		{"rate", required_argument, NULL, 'r'},
+		{"poisson", no_argument, NULL, 'P'},
+		{"count", required_argument, NULL, 'n'},
+		{"seed", required_argument, NULL, 'S'},
+		{"replay", no_argument, NULL, 'R'},
+		{"speed", required_argument, NULL, 'x'},
 		{0}
 	};
 	int opt;
 
 	int n_threads = 0, server_port = 0;
 	char *query_file = NULL, *server_host = NULL;
+	struct client_options options = {0};
+	struct bench_options bench_options = {.seed = 1, .speed = 1.0};
+	int benchmark = 0;
 
 	/* IP resolving */
 	int ret;
@@ -32,7 +43,7 @@ int main(int argc, char *argv[])
 	in_addr_t s_ip;
 	in_port_t s_port;
 
-	while ((opt = getopt_long_only(argc, argv, "q:w:", long_options, NULL)) != -1) {
+	while ((opt = getopt_long_only(argc, argv, "q:w:t", long_options, NULL)) != -1) {
 		switch (opt) {
 		case 'q':
 			query_file = strdup(optarg);
@@ -50,6 +61,38 @@ int main(int argc, char *argv[])
 			server_host = strdup(optarg);
 			break;
 
+		case 't':
+			options.trace = 1;
+			break;
+
+		case 'B':
+			benchmark = 1;
+			break;
+
+		case 'r':
+			bench_options.rate = atof(optarg);
+			break;
+
+		case 'P':
+			bench_options.poisson = 1;
+			break;
+
+		case 'n':
+			bench_options.count = atol(optarg);
+			break;
+
+		case 'S':
+			bench_options.seed = atoi(optarg);
+			break;
+
+		case 'R':
+			bench_options.replay = 1;
+			break;
+
+		case 'x':
+			bench_options.speed = atof(optarg);
+			break;
+
 		default:
 			return print_usage(argv[0]);
 		}
@@ -58,6 +101,9 @@ int main(int argc, char *argv[])
 	if (n_threads <= 0 || server_port < 0 || server_port > UINT16_MAX)
 		return print_usage(argv[0]);
 
+	if (bench_options.speed <= 0)
+		return print_usage(argv[0]);
+
 	if (!query_file || !server_host)
 		return print_usage(argv[0]);
 
@@ -76,13 +122,18 @@ int main(int argc, char *argv[])
 	freeaddrinfo(res);
 
 	/* The magic begins... */
-	return client(query_file, n_threads, s_port, s_ip);
+	if (benchmark)
+		return bench(query_file, n_threads, s_port, s_ip, &bench_options);
+
+	return client(query_file, n_threads, s_port, s_ip, &options);
 }
 
 
 int print_usage(const char *program)
 {
-	fprintf(stderr, "%s –q queryFile -w numThreads –sp servPort –sip servIP\n",
+	fprintf(stderr, "%s –q queryFile -w numThreads –sp servPort –sip servIP [-t]\n"
+	        "\t[-bench [-rate queriesPerSec [-poisson]] [-count queries] [-seed seed]\n"
+	        "\t        [-replay [-speed factor]]]\n",
 	        program);
 	return DA_INVALID_PARAMETER;
 }
@@ -0,0 +1,602 @@
+/* Native counterpart of create_infiles.sh, for datasets too big for bash.
+ * Same arguments and layout (<input_dir>/<Country>/<DD-MM-YYYY>, each file
+ * with numRecordsPerFile lines), but countries are generated in parallel,
+ * each from a generator seeded with (seed, country), so the output depends
+ * on the seed and the parameters only, not on the number of threads.
+ *
+ * Unlike the script, records are consistent: an EXIT record is always in a
+ * file of the same or a later date than its ENTER record, after it */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "histogram.h"
+
+/* Dates: 28-day months (all of them valid), starting from first_year */
+#define MONTH_DAYS 28
+#define YEAR_DAYS (12 * MONTH_DAYS)
+
+static const char *_names[] = {
+	"John", "Peter", "Eve", "Mary", "Constance", "Nick", "Sabrina", "Reginald",
+	"Ronald", "Helen", "Julia", "Julianna", "Maria", "Jonas", "Ruth", "Keith", "Ian",
+	"George", "Samantha", "Katerina", "Liam", "Sophie", "Irene", "Hope", "Jordan"
+};
+
+#define NAMES (sizeof(_names)/sizeof(_names[0]))
+
+struct patient {
+	uint64_t id;
+	unsigned char first_name, last_name, disease, age;
+};
+
+static struct {
+	int threads;
+	uint64_t seed;
+	double skew;                   /* Zipf exponent of disease popularity */
+	double exit_ratio;             /* Share of patients with an EXIT record */
+	double mean_stay;              /* Days, exponentially distributed */
+	uint64_t first_id;
+	uint64_t id_space;             /* 0: sequential IDs */
+	int first_year;
+	int years;
+} options = {
+	.threads = 4, .seed = 1, .skew = 0.0, .exit_ratio = 1.0, .mean_stay = 14.0,
+	.first_id = 1, .id_space = 0, .first_year = 2000, .years = 20
+};
+
+/* Thread-shared variables */
+static char **diseases, **countries;
+static int n_diseases, n_countries;
+static double *disease_cdf;
+
+static char *input_dir;
+static int files_per_dir, records_per_file;
+static size_t line_size;                  /* Upper bound of a line's length */
+static uint64_t id_multiplier;
+
+static atomic_int next;
+static atomic_ulong total_bytes;
+static atomic_int failed;
+
+/* splitmix64: small, fast, and good enough for test data */
+static uint64_t random_next(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9E3779B97F4A7C15);
+
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+
+	return z ^ (z >> 31);
+}
+
+/* In [0, 1) */
+static double random_uniform(uint64_t *state)
+{
+	return (random_next(state) >> 11) / 9007199254740992.0;
+}
+
+static int random_disease(uint64_t *state)
+{
+	double u = random_uniform(state);
+	int lo = 0, hi = n_diseases - 1, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+
+		if (disease_cdf[mid] > u)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return lo;
+}
+
+/* Patient <index> of country <c>: unique, and scattered over
+ * [first_id, first_id + id_space) if an ID space was given */
+static uint64_t patient_id(int c, uint64_t index)
+{
+	uint64_t global = (uint64_t) c * files_per_dir * records_per_file + index;
+
+	if (!options.id_space)
+		return options.first_id + global;
+
+	/* Bijection of [0, id_space), as id_multiplier and id_space are coprime */
+	return options.first_id + (global * id_multiplier + options.seed % options.id_space) % options.id_space;
+}
+
+static uint64_t gcd(uint64_t a, uint64_t b)
+{
+	uint64_t t;
+
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+static char *append(char *pos, const char *str)
+{
+	while (*str)
+		*pos++ = *str++;
+
+	return pos;
+}
+
+static char *append_number(char *pos, uint64_t n)
+{
+	char digits[20];
+	int i = 0;
+
+	do {
+		digits[i++] = '0' + n % 10;
+	} while (n /= 10);
+
+	while (i)
+		*pos++ = digits[--i];
+
+	return pos;
+}
+
+static char *append_record(char *pos, const struct patient *p, const char *mode)
+{
+	pos = append_number(pos, p->id);
+	*pos++ = ' ';
+	pos = append(pos, mode);
+	*pos++ = ' ';
+	pos = append(pos, _names[p->first_name]);
+	*pos++ = ' ';
+	pos = append(pos, _names[p->last_name]);
+	*pos++ = ' ';
+	pos = append(pos, diseases[p->disease]);
+	*pos++ = ' ';
+	pos = append_number(pos, p->age);
+	*pos++ = '\n';
+
+	return pos;
+}
+
+static int int_cmp(const void *a, const void *b)
+{
+	return *(const int*) a - *(const int*) b;
+}
+
+/* <n> distinct days in [0, range), sorted (Floyd's algorithm) */
+static int pick_days(int *days, int n, int range, uint64_t *state)
+{
+	char *taken;
+	int i, j, t;
+
+	if (!(taken = calloc(range, 1)))
+		return DA_ALLOCATION_ERROR;
+
+	for (i = 0, j = range - n; j < range; ++j) {
+		t = random_next(state) % (j + 1);
+
+		if (taken[t])
+			t = j;
+
+		taken[t] = 1;
+		days[i++] = t;
+	}
+
+	free(taken);
+	qsort(days, n, sizeof(days[0]), int_cmp);
+
+	return DA_OK;
+}
+
+/* First of days[from..n) >= day, n if none */
+static int lower_bound(const int *days, int from, int n, int day)
+{
+	int mid;
+
+	while (from < n) {
+		mid = (from + n) / 2;
+
+		if (days[mid] < day)
+			from = mid + 1;
+		else
+			n = mid;
+	}
+
+	return from;
+}
+
+static int write_file(const char *path, const char *buf, size_t len)
+{
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+		perror(path);
+		return DA_FILE_ERROR;
+	}
+
+	while (len) {
+		if ((n = write(fd, buf, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+
+			perror(path);
+			close(fd);
+			return DA_FILE_ERROR;
+		}
+
+		buf += n;
+		len -= n;
+	}
+
+	close(fd);
+
+	return DA_OK;
+}
+
+/* All the files of country <c>. Files are filled in date order: first the
+ * EXITs booked there by earlier ENTERs, then new patients (whose EXITs are
+ * booked in the file of their exit date, if there is room), then the EXITs
+ * of the patients that left on the same day */
+static int country_files(int c)
+{
+	size_t lines = (size_t) files_per_dir * records_per_file;
+	struct patient *pool = malloc(lines * sizeof(pool[0]));
+	int *exit_next = malloc(lines * sizeof(exit_next[0]));
+	int *exit_head = malloc(files_per_dir * sizeof(exit_head[0]));
+	int *booked = calloc(files_per_dir, sizeof(booked[0]));
+	int *days = malloc(files_per_dir * sizeof(days[0]));
+	char *buf = malloc(records_per_file * line_size);
+
+	char path[4096], *pos;
+	uint64_t state = options.seed * 0x100000001B3 + c;
+	int patients = 0, enters, i, j, k, day;
+	struct patient *p;
+
+	int ret = DA_OK;
+
+	if (!pool || !exit_next || !exit_head || !booked || !days || !buf) {
+		ret = DA_ALLOCATION_ERROR;
+		goto out;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", input_dir, countries[c]);
+
+	if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+		perror(path);
+		ret = DA_FILE_ERROR;
+		goto out;
+	}
+
+	if ((ret = pick_days(days, files_per_dir, options.years * YEAR_DAYS, &state)) != DA_OK)
+		goto out;
+
+	for (i = 0; i < files_per_dir; ++i)
+		exit_head[i] = -1;
+
+	for (i = 0; i < files_per_dir; ++i) {
+		pos = buf;
+
+		for (k = exit_head[i]; k != -1; k = exit_next[k])
+			pos = append_record(pos, pool + k, "EXIT");
+
+		exit_head[i] = -1;
+
+		for (enters = 0; enters + booked[i] < records_per_file; ++enters) {
+			k = patients++;
+			p = pool + k;
+
+			p->id = patient_id(c, k);
+			p->first_name = random_next(&state) % NAMES;
+			p->last_name = random_next(&state) % NAMES;
+			p->disease = random_disease(&state);
+			p->age = random_next(&state) % 120 + 1;
+
+			pos = append_record(pos, p, "ENTER");
+
+			if (random_uniform(&state) >= options.exit_ratio)
+				continue;
+
+			day = days[i] - options.mean_stay * log(1.0 - random_uniform(&state));
+			j = lower_bound(days, i, files_per_dir, day);
+
+			/* Room for this EXIT (and, today, this ENTER)? Else, later */
+			while (j < files_per_dir && booked[j] + (j == i ? enters + 1 : 0) >= records_per_file)
+				j++;
+
+			/* Still in hospital */
+			if (j == files_per_dir)
+				continue;
+
+			booked[j]++;
+			exit_next[k] = exit_head[j];
+			exit_head[j] = k;
+		}
+
+		for (k = exit_head[i]; k != -1; k = exit_next[k])
+			pos = append_record(pos, pool + k, "EXIT");
+
+		snprintf(path, sizeof(path), "%s/%s/%02d-%02d-%04d", input_dir, countries[c],
+		         days[i] % MONTH_DAYS + 1, days[i] / MONTH_DAYS % 12 + 1,
+		         options.first_year + days[i] / YEAR_DAYS);
+
+		if ((ret = write_file(path, buf, pos - buf)) != DA_OK)
+			goto out;
+
+		atomic_fetch_add(&total_bytes, pos - buf);
+	}
+
+out:
+	free(pool);
+	free(exit_next);
+	free(exit_head);
+	free(booked);
+	free(days);
+	free(buf);
+
+	return ret;
+}
+
+void *gen_thread(void *arg)
+{
+	int c;
+
+	while ((c = atomic_fetch_add(&next, 1)) < n_countries) {
+		if (country_files(c) != DA_OK) {
+			atomic_store(&failed, 1);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/* Non-empty lines of <path>. -1 on error */
+static int read_lines(const char *path, char ***lines)
+{
+	char line[256];
+	int n = 0, size = 0;
+	size_t len;
+	FILE *file;
+	void *tmp;
+
+	if (!(file = fopen(path, "r"))) {
+		perror(path);
+		return -1;
+	}
+
+	*lines = NULL;
+
+	while (fgets(line, sizeof(line), file)) {
+		len = strcspn(line, "\r\n");
+		line[len] = '\0';
+
+		if (!len)
+			continue;
+
+		if (n == size) {
+			size = size ? 2 * size : 16;
+
+			if (!(tmp = realloc(*lines, size * sizeof(char*)))) {
+				fclose(file);
+				return -1;
+			}
+
+			*lines = tmp;
+		}
+
+		(*lines)[n++] = strdup(line);
+	}
+
+	fclose(file);
+
+	return n;
+}
+
+/* mkdir -p */
+static int make_dirs(char *path)
+{
+	char *pos = path;
+
+	while ((pos = strchr(pos + 1, '/'))) {
+		*pos = '\0';
+
+		if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+			perror(path);
+			return DA_FILE_ERROR;
+		}
+
+		*pos = '/';
+	}
+
+	if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+		perror(path);
+		return DA_FILE_ERROR;
+	}
+
+	return DA_OK;
+}
+
+static int print_usage(const char *program)
+{
+	fprintf(stderr, "%s [-t threads] [-s seed] [-k skew] [-x exitRatio] [-m meanStayDays]\n"
+	        "\t[-i firstId] [-I idSpace] [-y firstYear] [-Y years]\n"
+	        "\tdiseasesFile countriesFile input_dir numFilesPerDirectory numRecordsPerFile\n",
+	        program);
+	return DA_INVALID_PARAMETER;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t *threads;
+	size_t name_len = 0, disease_len = 0;
+	uint64_t start, us;
+	double weight = 0.0;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "t:s:k:x:m:i:I:y:Y:")) != -1) {
+		switch (opt) {
+		case 't':
+			options.threads = atoi(optarg);
+			break;
+
+		case 's':
+			options.seed = strtoull(optarg, NULL, 10);
+			break;
+
+		case 'k':
+			options.skew = atof(optarg);
+			break;
+
+		case 'x':
+			options.exit_ratio = atof(optarg);
+			break;
+
+		case 'm':
+			options.mean_stay = atof(optarg);
+			break;
+
+		case 'i':
+			options.first_id = strtoull(optarg, NULL, 10);
+			break;
+
+		case 'I':
+			options.id_space = strtoull(optarg, NULL, 10);
+			break;
+
+		case 'y':
+			options.first_year = atoi(optarg);
+			break;
+
+		case 'Y':
+			options.years = atoi(optarg);
+			break;
+
+		default:
+			return print_usage(argv[0]);
+		}
+	}
+
+	if (argc - optind != 5)
+		return print_usage(argv[0]);
+
+	files_per_dir = atoi(argv[optind + 3]);
+	records_per_file = atoi(argv[optind + 4]);
+
+	if (options.threads <= 0 || options.skew < 0 || options.mean_stay < 0 ||
+	    options.exit_ratio < 0 || options.exit_ratio > 1 ||
+	    options.years <= 0 || options.first_year < 0 ||
+	    options.first_year + options.years > 10000 ||
+	    files_per_dir < 0 || records_per_file < 0)
+		return print_usage(argv[0]);
+
+	if (files_per_dir > options.years * YEAR_DAYS) {
+		fprintf(stderr, "At most %d files per directory in %d years\n",
+		        options.years * YEAR_DAYS, options.years);
+		return DA_INVALID_PARAMETER;
+	}
+
+	if ((n_diseases = read_lines(argv[optind], &diseases)) <= 0 ||
+	    (n_countries = read_lines(argv[optind + 1], &countries)) <= 0) {
+		fputs("Need at least a disease and a country\n", stderr);
+		return DA_FILE_ERROR;
+	}
+
+	if (n_diseases > 256) {
+		fputs("At most 256 diseases\n", stderr);
+		return DA_INVALID_PARAMETER;
+	}
+
+	if ((uint64_t) files_per_dir * records_per_file > INT32_MAX) {
+		fputs("Too many records per directory\n", stderr);
+		return DA_INVALID_PARAMETER;
+	}
+
+	/* IDs of a patient per line (at most), per country */
+	if (options.id_space) {
+		if (options.id_space < (uint64_t) n_countries * files_per_dir * records_per_file ||
+		    options.id_space > UINT32_MAX) {
+			fprintf(stderr, "idSpace must be in [%lu, %lu]\n",
+			        (unsigned long) n_countries * files_per_dir * records_per_file,
+			        (unsigned long) UINT32_MAX);
+			return DA_INVALID_PARAMETER;
+		}
+
+		/* Knuth's multiplicative hash constant, or close to it */
+		for (id_multiplier = 2654435761U % options.id_space;
+		     gcd(id_multiplier, options.id_space) != 1; ++id_multiplier)
+			continue;
+	}
+
+	/* Zipf: disease i (from 0) has weight 1 / (i + 1)^skew */
+	if (!(disease_cdf = malloc(n_diseases * sizeof(disease_cdf[0]))))
+		return DA_ALLOCATION_ERROR;
+
+	for (i = 0; i < n_diseases; ++i) {
+		weight += 1.0 / pow(i + 1, options.skew);
+		disease_cdf[i] = weight;
+
+		disease_len = MAX(disease_len, strlen(diseases[i]));
+	}
+
+	for (i = 0; i < n_diseases; ++i)
+		disease_cdf[i] /= weight;
+
+	for (i = 0; i < NAMES; ++i)
+		name_len = MAX(name_len, strlen(_names[i]));
+
+	/* "<id> ENTER <first> <last> <disease> <age>\n" */
+	line_size = 20 + 1 + 5 + 1 + name_len + 1 + name_len + 1 + disease_len + 1 + 3 + 1;
+
+	input_dir = argv[optind + 2];
+
+	if (make_dirs(input_dir) != DA_OK)
+		return DA_FILE_ERROR;
+
+	if (!(threads = malloc(options.threads * sizeof(threads[0]))))
+		return DA_ALLOCATION_ERROR;
+
+	atomic_init(&next, 0);
+	atomic_init(&total_bytes, 0);
+	atomic_init(&failed, 0);
+
+	start = histogram_clock();
+
+	for (i = 0; i < options.threads; ++i)
+		pthread_create(threads + i, NULL, gen_thread, NULL);
+
+	for (i = 0; i < options.threads; ++i)
+		pthread_join(threads[i], NULL);
+
+	us = MAX(histogram_clock() - start, 1);
+
+	printf("%d countries, %d files, %lu records, %.1f MB in %.3f s (%.1f MB/s)\n",
+	       n_countries, n_countries * files_per_dir,
+	       (unsigned long) n_countries * files_per_dir * records_per_file,
+	       atomic_load(&total_bytes) / 1e6, us / 1e6, atomic_load(&total_bytes) / (double) us);
+
+	for (i = 0; i < n_diseases; ++i)
+		free(diseases[i]);
+
+	for (i = 0; i < n_countries; ++i)
+		free(countries[i]);
+
+	free(diseases);
+	free(countries);
+	free(disease_cdf);
+	free(threads);
+
+	return atomic_load(&failed) ? DA_FILE_ERROR : DA_OK;
+}
@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "histogram.h"
+
+static const double _quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+/* Values below HIST_SUB_BUCKETS get a bucket each. Above that, the top
+ * HIST_SUB_BITS bits after the most significant one pick the bucket */
+static int bucket_index(uint64_t value)
+{
+	int shift;
+
+	if (value < HIST_SUB_BUCKETS)
+		return value;
+
+	shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+
+	return ((shift + 1) << HIST_SUB_BITS) + (value >> shift) - HIST_SUB_BUCKETS;
+}
+
+/* Highest value that falls in the bucket */
+static uint64_t bucket_value(int index)
+{
+	int shift = (index >> HIST_SUB_BITS) - 1;
+	uint64_t sub = index & (HIST_SUB_BUCKETS - 1);
+
+	if (shift < 0)
+		return index;
+
+	return ((sub + HIST_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+void histogram_init(struct histogram *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = UINT64_MAX;
+}
+
+void histogram_record(struct histogram *h, uint64_t value)
+{
+	h->bucket[bucket_index(value)]++;
+	h->count++;
+	h->sum += value;
+
+	if (value < h->min)
+		h->min = value;
+
+	if (value > h->max)
+		h->max = value;
+}
+
+void histogram_merge(struct histogram *dst, const struct histogram *src)
+{
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; ++i)
+		dst->bucket[i] += src->bucket[i];
+
+	dst->count += src->count;
+	dst->sum += src->sum;
+
+	if (src->min < dst->min)
+		dst->min = src->min;
+
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+uint64_t histogram_quantile(const struct histogram *h, double quantile)
+{
+	uint64_t rank, seen = 0;
+	int i;
+
+	if (!h->count)
+		return 0;
+
+	/* Rank of the value we're looking for (1 to count) */
+	rank = quantile * h->count + 0.5;
+
+	if (rank < 1)
+		rank = 1;
+
+	for (i = 0; i < HIST_BUCKETS; ++i) {
+		seen += h->bucket[i];
+
+		/* Never report past the extremes actually recorded */
+		if (seen >= rank) {
+			if (bucket_value(i) > h->max)
+				return h->max;
+
+			return bucket_value(i) < h->min ? h->min : bucket_value(i);
+		}
+	}
+
+	return h->max;
+}
+
+int histogram_format(char *buf, size_t size, const char *name, const char *labels,
+                     const struct histogram *h)
+{
+	const char *open = *labels ? "{" : "", *close = *labels ? "}" : "";
+	size_t len = 0;
+	int i, n;
+
+	for (i = 0; i < sizeof(_quantiles)/sizeof(_quantiles[0]); ++i) {
+		n = snprintf(buf + len, size - len, "%s{%s%squantile=\"%g\"} %lu\n",
+		             name, labels, *labels ? "," : "", _quantiles[i],
+		             (unsigned long) histogram_quantile(h, _quantiles[i]));
+
+		if (n < 0)
+			return n;
+
+		len += n;
+
+		if (len >= size)
+			return len;
+	}
+
+	n = snprintf(buf + len, size - len, "%s_sum%s%s%s %lu\n%s_count%s%s%s %lu\n",
+	             name, open, labels, close, (unsigned long) h->sum,
+	             name, open, labels, close, (unsigned long) h->count);
+
+	return n < 0 ? n : (int) (len + n);
+}
+
+uint64_t histogram_clock(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
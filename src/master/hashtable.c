@@ -26,6 +26,12 @@ static struct hash_table *diseases_ht;
 
 static int bucket_size, max_bucket_entries;
 
+static struct ht_stats stats;
+
+/* Countries left out of the current request's results (see hashtable.h) */
+static char **excluded;
+static int n_excluded;
+
 int string_hash(struct hash_table *ht, char *_str)
 {
 	unsigned long hash = 5381;
@@ -260,10 +266,9 @@ int country_num_patient_admissions(struct tree_node *country, char *disease, str
 	age_group[2] = 0;
 	age_group[3] = 0;
 
-	if (!(country = tree_find_gte_node(country, date1)))
-		return 0;
+	stats.scans++;
 
-	record = tree_get_next_record(country);
+	record = tree_seek(country, date1);
 	while (record) {
 		/* Stop when we surpass date2 */
 		if (datecmp(&record->entry_date, date2) > 0)
@@ -280,6 +285,7 @@ int country_num_patient_admissions(struct tree_node *country, char *disease, str
 				age_group[3]++;
 		}
 
+		stats.visited++;
 		record = tree_get_next_record(NULL);
 	}
 
@@ -295,6 +301,8 @@ int country_num_patient_discharges(struct tree_node *country, char *disease, str
 	age_group[2] = 0;
 	age_group[3] = 0;
 
+	stats.scans++;
+
 	record = tree_get_next_record(country);
 	while (record) {
 		if (!null_date(&record->exit_date)) {
@@ -312,12 +320,125 @@ int country_num_patient_discharges(struct tree_node *country, char *disease, str
 			}
 		}
 
+		stats.visited++;
 		record = tree_get_next_record(NULL);
 	}
 
 	return age_group[0] + age_group[1] + age_group[2] + age_group[3];
 }
 
+void ht_get_stats(struct ht_stats *_stats)
+{
+	*_stats = stats;
+}
+
+void ht_exclude_countries(char **countries, int n)
+{
+	excluded = countries;
+	n_excluded = n;
+}
+
+int ht_country_served(char *country)
+{
+	int i;
+
+	for (i = 0; i < n_excluded; ++i) {
+		if (!strcmp(excluded[i], country))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* For queries: NULL if we don't have it, or don't serve it */
+static struct tree_node *find_served_country_tree(char *country)
+{
+	if (!ht_country_served(country))
+		return NULL;
+
+	return find_country_tree(country);
+}
+
+/* Balanced tree of records[0..n), sorted: the middle one first */
+static struct tree_node *tree_rebuild(struct tree_node *root, struct record **records, int n)
+{
+	if (n <= 0)
+		return root;
+
+	root = tree_insert(root, records[n / 2]);
+	root = tree_rebuild(root, records, n / 2);
+
+	return tree_rebuild(root, records + n / 2 + 1, n - n / 2 - 1);
+}
+
+/* Records of <country> out of the disease trees and the records hash table,
+ * then the country itself */
+int ht_drop_country(char *country)
+{
+	struct bucket *bucket;
+	struct bucket_entry *disease;
+	struct record **records = NULL, *record;
+	char *name = NULL;
+	int hash, i, n, size = 0;
+	void *tmp;
+
+	hash = string_hash(countries_ht, country);
+
+	for (bucket = countries_ht->bucket[hash]; bucket; bucket = bucket->next) {
+		for (i = 0; i < bucket->count; ++i) {
+			if (!strcmp(bucket->entry[i].name, country)) {
+				name = bucket->entry[i].name;
+				break;
+			}
+		}
+
+		if (name)
+			break;
+	}
+
+	if (!name)
+		return DA_INVALID_COUNTRY;
+
+	/* Disease trees: the records of the other countries, rebuilt */
+	for (disease = get_next_entry(diseases_ht, 1); disease;
+	     disease = get_next_entry(diseases_ht, 0)) {
+		n = 0;
+
+		for (record = tree_get_next_record(disease->tree); record;
+		     record = tree_get_next_record(NULL)) {
+			if (record->country == name)
+				continue;
+
+			if (n == size) {
+				size = size ? 2 * size : 1024;
+
+				if (!(tmp = realloc(records, size * sizeof(records[0])))) {
+					free(records);
+					return DA_ALLOCATION_ERROR;
+				}
+
+				records = tmp;
+			}
+
+			records[n++] = record;
+		}
+
+		tree_destroy(disease->tree);
+		disease->tree = tree_rebuild(NULL, records, n);
+	}
+
+	free(records);
+
+	tree_destroy(bucket->entry[i].tree);
+	stats.records -= records_drop(name);
+
+	/* Last entry of the bucket takes its place */
+	bucket->entry[i] = bucket->entry[--bucket->count];
+	free(name);
+
+	return DA_OK;
+}
+
 /* Commands Implementation */
 int insert_record(struct record *tmp)
 {
@@ -334,13 +455,15 @@ int insert_record(struct record *tmp)
 	ht_insert(diseases_ht, patient_record);
 	ht_insert(countries_ht, patient_record);
 
+	stats.records++;
+
 	return DA_OK;
 }
 
 int file_statistics(char *country, char *file, int response_fd)
 {
 	struct bucket_entry *disease;
-	struct tree_node *tree, *node;
+	struct tree_node *tree;
 	struct record *record;
 
 	struct date date = to_date(file);
@@ -357,8 +480,8 @@ int file_statistics(char *country, char *file, int response_fd)
 		return DA_INVALID_COUNTRY;
 	}
 
-	/* Subtree rooted at first record with entry date >= file */
-	if (!(tree = tree_find_gte_node(tree, &date))) {
+	/* Any records with entry date >= file? */
+	if (!tree_find_gte_node(tree, &date)) {
 		fprintf(stderr, "%s %s: no such date with enter\n", country, file);
 		return DA_INVALID_DATE;
 	}
@@ -374,10 +497,8 @@ int file_statistics(char *country, char *file, int response_fd)
 		age_group[2] = 0;
 		age_group[3] = 0;
 
-		node = tree;
-		while (node) {
-			record = node->patient_record;
-
+		record = tree_seek(tree, &date);
+		while (record) {
 			/* Stop when we surpass this date */
 			if (datecmp(&record->entry_date, &date) > 0)
 				break;
@@ -393,7 +514,7 @@ int file_statistics(char *country, char *file, int response_fd)
 					age_group[3]++;
 			}
 
-			node = node->right;               /* for >=, go right */
+			record = tree_get_next_record(NULL);
 		}
 
 		msg_write_line(response_fd, disease->name);
@@ -444,7 +565,7 @@ int topk_age_ranges(int k, char *country, char *disease, struct date *date1, str
 	int i, max;
 	char buf[1024];
 
-	if (!(tree = find_country_tree(country)))
+	if (!(tree = find_served_country_tree(country)))
 		return DA_INVALID_COUNTRY;
 
 	if (!valid_interval(date1, date2))
@@ -486,7 +607,7 @@ int num_patient_admissions(char *disease, struct date *date1, struct date *date2
 	char buf[1024];
 
 	if (country) {
-		if (!(tree = find_country_tree(country)))
+		if (!(tree = find_served_country_tree(country)))
 			return DA_INVALID_COUNTRY;
 
 		if (!valid_interval(date1, date2))
@@ -506,6 +627,11 @@ int num_patient_admissions(char *disease, struct date *date1, struct date *date2
 	/* All countries */
 	entry = get_next_entry(countries_ht, 1);
 	while (entry) {
+		if (!ht_country_served(entry->name)) {
+			entry = get_next_entry(countries_ht, 0);
+			continue;
+		}
+
 		snprintf(buf, sizeof(buf), "%s %d",
 		         entry->name,
 		         country_num_patient_admissions(entry->tree, disease, date1, date2, age_group));
@@ -526,7 +652,7 @@ int num_patient_discharges(char *disease, struct date *date1, struct date *date2
 	char buf[1024];
 
 	if (country) {
-		if (!(tree = find_country_tree(country)))
+		if (!(tree = find_served_country_tree(country)))
 			return DA_INVALID_COUNTRY;
 
 		if (!valid_interval(date1, date2))
@@ -546,6 +672,11 @@ int num_patient_discharges(char *disease, struct date *date1, struct date *date2
 	/* All countries */
 	entry = get_next_entry(countries_ht, 1);
 	while (entry) {
+		if (!ht_country_served(entry->name)) {
+			entry = get_next_entry(countries_ht, 0);
+			continue;
+		}
+
 		snprintf(buf, sizeof(buf), "%s %d",
 		         entry->name,
 		         country_num_patient_discharges(entry->tree, disease, date1, date2, age_group));
@@ -558,6 +689,58 @@ int num_patient_discharges(char *disease, struct date *date1, struct date *date2
 	return DA_OK;
 }
 
+/* Same as num_patient_*, but sums everything up in a typed partial result */
+int aggregate_patients(enum mode mode, char *disease, struct date *date1, struct date *date2, char *country, struct p_aggregate *agg)
+{
+	int (*count)(struct tree_node*, char*, struct date*, struct date*, int*);
+	struct bucket_entry *entry;
+	struct tree_node *tree;
+	int age_group[4], i;
+
+	memset(agg, 0, sizeof(*agg));
+
+	if (mode == ENTER)
+		count = country_num_patient_admissions;
+	else
+		count = country_num_patient_discharges;
+
+	if (country) {
+		if (!(tree = find_served_country_tree(country)))
+			return agg->status = DA_INVALID_COUNTRY;
+
+		if (!valid_interval(date1, date2))
+			return agg->status = DA_INVALID_DATE;
+
+		agg->count = count(tree, disease, date1, date2, age_group);
+
+		for (i = 0; i < 4; ++i)
+			agg->age_group[i] = age_group[i];
+
+		return DA_OK;
+	}
+
+	if (!valid_interval(date1, date2))
+		return agg->status = DA_INVALID_DATE;
+
+	/* All countries */
+	entry = get_next_entry(countries_ht, 1);
+	while (entry) {
+		if (!ht_country_served(entry->name)) {
+			entry = get_next_entry(countries_ht, 0);
+			continue;
+		}
+
+		agg->count += count(entry->tree, disease, date1, date2, age_group);
+
+		for (i = 0; i < 4; ++i)
+			agg->age_group[i] += age_group[i];
+
+		entry = get_next_entry(countries_ht, 0);
+	}
+
+	return DA_OK;
+}
+
 /* rest */
 int have_date_records(struct tree_node *country, char *file)
 {
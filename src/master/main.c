@@ -17,8 +17,8 @@ int main(int argc, char *argv[])
 {
 	/* Parameters & relevant checking */
 	int opt;
-	int workers = 0, buffer_size = 0, server_port = 0;
-	char *server_host = NULL, *input_dir = NULL;
+	int workers = 0, buffer_size = 0, server_port = 0, replicas = 1, standby = 0;
+	char *server_host = NULL, *input_dir = NULL, *assign_file = NULL;
 
 	char str_server_port[16];
 
@@ -31,7 +31,7 @@ int main(int argc, char *argv[])
 	struct dirent *entry;
 	int subdirs = 0;
 
-	while ((opt = getopt(argc, argv, "w:b:s:p:i:")) != -1) {
+	while ((opt = getopt(argc, argv, "w:b:s:p:i:a:r:S")) != -1) {
 		switch (opt) {
 		case 'w':
 			workers = atoi(optarg);
@@ -53,12 +53,24 @@ int main(int argc, char *argv[])
 			input_dir = strdup(optarg);
 			break;
 
+		case 'a':
+			assign_file = optarg;
+			break;
+
+		case 'r':
+			replicas = atoi(optarg);
+			break;
+
+		case 'S':
+			standby = 1;
+			break;
+
 		default:
 			return print_usage(argv[0]);
 		}
 	}
 
-	if (workers <= 0 || buffer_size <= 0 || server_port <= 0 || server_port > UINT16_MAX)
+	if (workers <= 0 || buffer_size <= 0 || replicas <= 0 || server_port <= 0 || server_port > UINT16_MAX)
 		return print_usage(argv[0]);
 
 	if (!server_host || !input_dir)
@@ -104,17 +116,19 @@ int main(int argc, char *argv[])
 
 	closedir(dir);
 
-	/* No more workers than there are directories */
-	workers = MIN(workers, subdirs);
+	/* No more workers than there are directories (replicas), and no more
+	 * replicas than workers */
+	workers = MIN(workers, subdirs * replicas);
+	replicas = MIN(replicas, workers);
 
 	/* The magic begins... */
-	return master(workers, buffer_size, strdup(server_host), str_server_port, input_dir);
+	return master(workers, replicas, standby, buffer_size, strdup(server_host), str_server_port, input_dir, assign_file);
 }
 
 
 int print_usage(const char *program)
 {
-	fprintf(stderr, "%s –w numWorkers -b bufferSize -s serverIP -p serverPort -i input_dir\n",
+	fprintf(stderr, "%s –w numWorkers -b bufferSize -s serverIP -p serverPort -i input_dir [-a assignmentFile] [-r replicas] [-S]\n",
 	        program);
 	return DA_INVALID_PARAMETER;
 }
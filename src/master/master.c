@@ -1,6 +1,8 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -38,16 +40,44 @@ static struct country_entry {
 	struct country_entry *next;
 } **countries;
 
+/* Replicas of every country: workers form as many groups (see
+ * m_assign_directories) */
+static int replicas = 1;
+
+/* Warm standbys (see master.h): loaded, per worker, -1 if there's none */
+static int *standby_pid, *standby_fd;
+
+/* Control pipe (see master.h), and the migration in progress */
+static int control_fd = -1;
+
+static struct {
+	char *country;                                   /* NULL: none */
+	int source, target;
+} migration;
+
+/* Size of a country directory, for the assignment */
+struct country_size {
+	char *name;
+	int files;
+	off_t bytes;
+	int worker;                         /* -1: not (yet) assigned */
+};
+
 /* Declarations */
-int m_assign_directories(char *input_dir, int workers);
-int spawn_worker(int workers, char *input_dir, int w, char *server_ip, char *server_port, int *pid, int *request_fd);
-int m_exit(char *input_dir, int workers, int *pid);
+int m_assign_directories(char *input_dir, int workers, char *assign_file);
+int m_group(int w, int workers);
+int spawn_worker(int workers, char *input_dir, int w, char *server_ip, char *server_port, int *pid, int *request_fd, int standby);
+void m_replace(int workers, char *input_dir, int w, char *server_ip, char *server_port, int *pid, int *request_fd);
+void m_control(int workers, char *input_dir, char *server_ip, char *server_port, int *pid, int *request_fd);
+int m_exit(char *input_dir, int workers, int *pid, int *request_fd);
 
 /* Implementation */
-int master(int workers, int buffer_size, char *server_ip, char *server_port, char *input_dir)
+int master(int workers, int _replicas, int standby, int buffer_size, char *server_ip, char *server_port, char *input_dir, char *assign_file)
 {
-	int request_fd[workers];            /* Request (directories) pipe fds */
+	int request_fd[workers];   /* Request (directories, migration) pipe fds */
 	int pid[workers], w, child_pid;
+	int _standby_pid[workers], _standby_fd[workers];
+	struct pollfd control;
 
 	/* Setup Signal Handlers */
 	sigact.sa_sigaction = m_sig_handler;
@@ -58,39 +88,73 @@ int master(int workers, int buffer_size, char *server_ip, char *server_port, cha
 
 	pipes_init(buffer_size);
 
-	m_assign_directories(input_dir, workers);
+	replicas = MAX(1, MIN(_replicas, workers));
+
+	if (m_assign_directories(input_dir, workers, assign_file) != DA_OK) {
+		fprintf(stderr, "master: %s: could not assign directories\n", input_dir);
+		return DA_FILE_ERROR;
+	}
+
+	/* Read-write: never EOF, even with no writers around */
+	mkfifo(CONTROL_PIPE, 0600);
+
+	if ((control_fd = open(CONTROL_PIPE, O_RDWR | O_NONBLOCK)) == -1)
+		perror("master: " CONTROL_PIPE);
+
+	control.fd = control_fd;
+	control.events = POLLIN;
 
 	/* Spawn Workers */
 	for (w = 0; w < workers; ++w) {
-		spawn_worker(workers, input_dir, w, server_ip, server_port, pid, request_fd);
+		request_fd[w] = -1;
+		_standby_pid[w] = _standby_fd[w] = -1;
 	}
 
+	if (standby) {
+		standby_pid = _standby_pid;
+		standby_fd = _standby_fd;
+	}
+
+	for (w = 0; w < workers; ++w) {
+		spawn_worker(workers, input_dir, w, server_ip, server_port, pid, request_fd, 0);
+	}
+
+	for (w = 0; standby && w < workers; ++w)
+		spawn_worker(workers, input_dir, w, server_ip, server_port, pid, request_fd, 1);
+
 	/* Wait for signals (Maybe a worker died...) */
 	while (!master_quit) {
 		if (worker_died) {
-			/* Get return value of child (tag) */
-			child_pid = wait(&w);
-
-			/* Get worker tag */
-			if (WIFEXITED(w)) {
-				w = WEXITSTATUS(w);
-			} else {
-				for (w = 0; w < workers; ++w) {
-					if (child_pid == pid[w])
-						break;
+			worker_died = 0;
+
+			/* Any number of them, standbys included */
+			while ((child_pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+				for (w = 0; w < workers && child_pid != pid[w]; ++w)
+					continue;
+
+				if (w < workers) {
+					m_replace(workers, input_dir, w, server_ip, server_port, pid, request_fd);
+					continue;
 				}
-			}
 
-			/* Replace dead worker */
-			spawn_worker(workers, input_dir, w, server_ip, server_port, pid, request_fd);
+				for (w = 0; standby && w < workers; ++w) {
+					if (child_pid != standby_pid[w])
+						continue;
 
-			worker_died = 0;
+					close(standby_fd[w]);
+					standby_pid[w] = standby_fd[w] = -1;
+
+					spawn_worker(workers, input_dir, w, server_ip, server_port, pid, request_fd, 1);
+				}
+			}
 		}
 
-		pause();
+		/* Wait for signals, or commands on the control pipe */
+		if (poll(&control, 1, -1) > 0)
+			m_control(workers, input_dir, server_ip, server_port, pid, request_fd);
 	}
 
-	m_exit(input_dir, workers, pid);
+	m_exit(input_dir, workers, pid, request_fd);
 
 	free(server_ip);
 	free(input_dir);
@@ -98,13 +162,103 @@ int master(int workers, int buffer_size, char *server_ip, char *server_port, cha
 	return DA_OK;
 }
 
-int m_assign_directories(char *input_dir, int workers)
+/* Files and bytes of a country directory */
+static int m_measure_directory(char *input_dir, struct country_size *country)
+{
+	char path[PATH_MAX];
+	DIR *dir;
+	struct dirent *entry;
+	struct stat s;
+
+	snprintf(path, sizeof(path), "%s/%s", input_dir, country->name);
+
+	if (!(dir = opendir(path)))
+		return DA_FILE_ERROR;
+
+	while ((entry = readdir(dir))) {
+		if (fstatat(dirfd(dir), entry->d_name, &s, 0) == -1 || !S_ISREG(s.st_mode))
+			continue;
+
+		country->files++;
+		country->bytes += s.st_size;
+	}
+
+	closedir(dir);
+
+	return DA_OK;
+}
+
+/* Biggest first (by name, for ties) */
+static int m_size_cmp(const void *a, const void *b)
+{
+	const struct country_size *c1 = a, *c2 = b;
+
+	if (c1->bytes != c2->bytes)
+		return c1->bytes < c2->bytes ? 1 : -1;
+
+	return strcmp(c1->name, c2->name);
+}
+
+/* Config file: "<country> <worker>" lines, '#' for comments.
+ * Countries not in there are assigned by size */
+static int m_read_assignments(char *assign_file, struct country_size *size, int n, int workers)
+{
+	char line[512], name[256];
+	FILE *file;
+	int i, w;
+
+	if (!(file = fopen(assign_file, "r"))) {
+		perror(assign_file);
+		return DA_FILE_ERROR;
+	}
+
+	while (fgets(line, sizeof(line), file)) {
+		if (line[strspn(line, " \t")] == '#' ||
+		    sscanf(line, "%255s %d", name, &w) != 2)
+			continue;
+
+		for (i = 0; i < n && strcmp(size[i].name, name); ++i)
+			continue;
+
+		if (i == n)
+			fprintf(stderr, "%s: %s: no such country\n", assign_file, name);
+		else if (w < 0 || w >= workers)
+			fprintf(stderr, "%s: %s: no worker %d\n", assign_file, name, w);
+		else
+			size[i].worker = w;
+	}
+
+	fclose(file);
+
+	return DA_OK;
+}
+
+/* Replica group of worker <w>: workers are split in <replicas> groups of
+ * consecutive tags */
+int m_group(int w, int workers)
+{
+	return ((w + 1) * replicas - 1) / workers;
+}
+
+/* Longest Processing Time first: biggest remaining country to the worker
+ * with the fewest bytes so far. Bytes (lines, really) is what a worker
+ * spends its startup on, and what fan-out queries scan.
+ * Every group of workers gets a replica of every country, so any group can
+ * answer a fan-out query on its own (see server/route.h) */
+int m_assign_directories(char *input_dir, int workers, char *assign_file)
 {
 	DIR *dir;
 	struct dirent *entry;
 
+	struct country_size *size = NULL, *tmp;
 	struct country_entry *new;
-	int w;
+	int n = 0, capacity = 0, i, w, g, least, first, last;
+	int *replica = NULL;                    /* Worker of replica g of i */
+
+	off_t load[workers];
+	int files[workers], n_countries[workers];
+
+	int ret = DA_OK;
 
 	if (!(countries = calloc(workers, sizeof(countries[0]))))
 		return DA_ALLOCATION_ERROR;
@@ -112,49 +266,171 @@ int m_assign_directories(char *input_dir, int workers)
 	if (!(dir = opendir(input_dir)))
 		return DA_FILE_ERROR;
 
-	/* Iterate though directories and assign */
-	w = 0;
+	/* Measure the directories */
 	while ((entry = readdir(dir))) {
 		if (entry->d_type == DT_DIR) {
 			if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
 				continue;
 
-			new = malloc(sizeof(*new));
+			if (n == capacity) {
+				capacity = capacity ? 2 * capacity : 16;
 
-			new->name = strdup(entry->d_name);
-			new->next = countries[w];
+				if (!(tmp = realloc(size, capacity * sizeof(size[0])))) {
+					ret = DA_ALLOCATION_ERROR;
+					break;
+				}
 
-			countries[w] = new;
+				size = tmp;
+			}
+
+			size[n].name = strdup(entry->d_name);
+			size[n].files = 0;
+			size[n].bytes = 0;
+			size[n].worker = -1;
 
-			/* Round Robin */
-			if (++w == workers)
-				w = 0;
+			m_measure_directory(input_dir, size + n);
+			n++;
 		}
 	}
 
 	closedir(dir);
 
-	return DA_OK;
+	if (ret == DA_OK && assign_file)
+		ret = m_read_assignments(assign_file, size, n, workers);
+
+	if (ret != DA_OK)
+		goto out;
+
+	qsort(size, n, sizeof(size[0]), m_size_cmp);
+
+	if (!(replica = malloc((n * replicas + 1) * sizeof(replica[0])))) {
+		ret = DA_ALLOCATION_ERROR;
+		goto out;
+	}
+
+	for (w = 0; w < workers; ++w) {
+		load[w] = 0;
+		files[w] = 0;
+		n_countries[w] = 0;
+	}
+
+	/* Pinned countries first, then the rest */
+	for (i = 0; i < n; ++i) {
+		if (size[i].worker >= 0) {
+			load[size[i].worker] += size[i].bytes;
+			n_countries[size[i].worker]++;
+		}
+	}
+
+	for (i = 0; i < n; ++i) {
+		for (g = 0; g < replicas; ++g) {
+			first = g * workers / replicas;
+			last = (g + 1) * workers / replicas;
+
+			if (size[i].worker >= first && size[i].worker < last) {
+				replica[i * replicas + g] = size[i].worker;
+				continue;
+			}
+
+			for (least = first, w = first + 1; w < last; ++w) {
+				if (load[w] < load[least] || (load[w] == load[least] &&
+				                              n_countries[w] < n_countries[least]))
+					least = w;
+			}
+
+			replica[i * replicas + g] = least;
+			load[least] += size[i].bytes;
+			n_countries[least]++;
+		}
+	}
+
+	/* Smallest first in the lists: they are built backwards */
+	for (i = n - 1; i >= 0; --i) {
+		for (g = 0; g < replicas; ++g) {
+			w = replica[i * replicas + g];
+
+			if (!(new = malloc(sizeof(*new))) || !(new->name = strdup(size[i].name))) {
+				free(new);
+				ret = DA_ALLOCATION_ERROR;
+				goto out;
+			}
+
+			new->next = countries[w];
+			countries[w] = new;
+
+			files[w] += size[i].files;
+		}
+	}
+
+	/* Report */
+	for (w = 0; w < workers; ++w) {
+		printf("Worker %d: %d countries, %d files, %.1f MB:", w,
+		       n_countries[w], files[w], load[w] / 1e6);
+
+		if (replicas > 1)
+			printf(" (replica %d)", m_group(w, workers));
+
+		for (new = countries[w]; new; new = new->next)
+			printf(" %s", new->name);
+
+		putchar('\n');
+	}
+
+	fflush(stdout);
+
+out:
+	for (i = 0; i < n; ++i)
+		free(size[i].name);
+
+	free(size);
+	free(replica);
+
+	return ret;
 }
 
-int spawn_worker(int workers, char *input_dir, int w, char *server_ip, char *server_port, int *pid, int *request_fd)
+int spawn_worker(int workers, char *input_dir, int w, char *server_ip, char *server_port, int *pid, int *request_fd, int standby)
 {
 	char p_request[64];                            /* Named pipe filename */
 	struct country_entry *entry, *next;
+	int *fd = request_fd;
 	int i, ret;
 
 	if (w >= workers)
 		return DA_INVALID_PARAMETER;
 
+	/* A standby has its own pipe, and pid */
+	if (standby) {
+		pid = standby_pid;
+		fd = standby_fd;
+	}
+
 	/* Create and open pipes on parent end */
-	snprintf(p_request, sizeof(p_request), "/tmp/p_request.%d", w);
+	snprintf(p_request, sizeof(p_request), standby ? "/tmp/p_standby.%d" : "/tmp/p_request.%d", w);
 	mkfifo(p_request, 0600);
 
+	/* Pipe of the worker this one replaces */
+	if (fd[w] != -1) {
+		close(fd[w]);
+		fd[w] = -1;
+	}
+
 	/* Fork:
 	* Worker will open request pipe (R) on the other side */
 	pid[w] = fork();
 	if (!pid[w]) {                                 /* Worker Path */
-		ret = worker(w, input_dir);
+		/* The master's ends of the pipes */
+		for (i = 0; i < workers; ++i) {
+			if (request_fd[i] != -1)
+				close(request_fd[i]);
+
+			if (standby_fd && standby_fd[i] != -1)
+				close(standby_fd[i]);
+		}
+
+		if (control_fd != -1)
+			close(control_fd);
+
+		ret = worker(w, input_dir, standby);
 
 		/* Free data structures left over from parent */
 		if (countries) {
@@ -183,34 +459,233 @@ int spawn_worker(int workers, char *input_dir, int w, char *server_ip, char *ser
 	/* Master Path */
 
 	/* Open request pipe (W) */
-	request_fd[w] = open(p_request, O_WRONLY);
+	fd[w] = open(p_request, O_WRONLY);
 
-	if (request_fd[w] == -1) {
+	if (fd[w] == -1) {
 		perror("master: request_fd");
 		exit(DA_PIPE_ERROR);
 	}
 
+	/* Both ends are open: the next standby gets a pipe of its own, even
+	 * while this one (activated) still reads from it */
+	if (standby)
+		unlink(p_request);
+
 	/* Send the assigned directories */
 	entry = countries[w];
 	while (entry) {
-		msg_write_line(request_fd[w], entry->name);
+		msg_write_line(fd[w], entry->name);
 		entry = entry->next;
 	}
 
-	msg_done(request_fd[w]);
+	msg_done(fd[w]);
 
 	/* Announce server host:port */
-	msg_write_line(request_fd[w], server_ip);
-	msg_write_line(request_fd[w], server_port);
-	msg_done(request_fd[w]);
+	msg_write_line(fd[w], server_ip);
+	msg_write_line(fd[w], server_port);
+	msg_done(fd[w]);
 
-	msg_ready(request_fd[w]);
-	close(request_fd[w]);
+	msg_ready(fd[w]);
 
-	return DA_OK;
+	return DA_OK;                        /* Pipe stays open, for migrations */
 }
 
-int m_exit(char *input_dir, int workers, int *pid)
+/* Worker <w> died: its standby takes over (it's loaded already, and only
+ * needs to announce its port to the server), and a new standby starts
+ * loading. Without one, a new worker starts from scratch */
+void m_replace(int workers, char *input_dir, int w, char *server_ip, char *server_port, int *pid, int *request_fd)
+{
+	/* It won't answer: the country stays where it was */
+	if (migration.country && w == migration.target) {
+		fprintf(stderr, "master: migration of %s aborted\n", migration.country);
+
+		free(migration.country);
+		migration.country = NULL;
+	}
+
+	/* Still alive? */
+	if (!standby_pid || standby_pid[w] == -1 || waitpid(standby_pid[w], NULL, WNOHANG)) {
+		if (standby_pid && standby_pid[w] != -1) {
+			close(standby_fd[w]);
+			standby_pid[w] = standby_fd[w] = -1;
+		}
+
+		spawn_worker(workers, input_dir, w, server_ip, server_port, pid, request_fd, 0);
+	} else {
+		msg_write_line(standby_fd[w], CMD_ACTIVATE);
+		msg_done(standby_fd[w]);
+
+		close(request_fd[w]);
+
+		pid[w] = standby_pid[w];
+		request_fd[w] = standby_fd[w];
+		standby_pid[w] = standby_fd[w] = -1;
+
+		printf("Worker %d: standby took over\n", w);
+		fflush(stdout);
+	}
+
+	if (standby_pid)
+		spawn_worker(workers, input_dir, w, server_ip, server_port, pid, request_fd, 1);
+}
+
+/* The countries of worker <w> changed: its standby loads them again */
+static void m_refresh_standby(int workers, char *input_dir, int w, char *server_ip, char *server_port, int *pid, int *request_fd)
+{
+	if (!standby_pid)
+		return;
+
+	if (standby_pid[w] != -1) {
+		kill(standby_pid[w], SIGKILL);
+		close(standby_fd[w]);
+		standby_pid[w] = standby_fd[w] = -1;
+	}
+
+	spawn_worker(workers, input_dir, w, server_ip, server_port, pid, request_fd, 1);
+}
+
+/* Does worker <w> have <name>? Returns the list link pointing to it */
+static struct country_entry **m_find_country(char *name, int w)
+{
+	struct country_entry **entry;
+
+	for (entry = &countries[w]; *entry; entry = &(*entry)->next) {
+		if (!strcmp((*entry)->name, name))
+			return entry;
+	}
+
+	return NULL;
+}
+
+/* Operator: move <name> to worker <target> (one migration at a time).
+ * With replicas, the one moving is the replica of the target's group */
+static void m_migrate(char *name, int target, int workers, int *request_fd)
+{
+	char source_tag[16];
+	int source = -1, w;
+
+	if (target < 0 || target >= workers) {
+		fprintf(stderr, "master: no worker %d\n", target);
+		return;
+	}
+
+	if (migration.country) {
+		fprintf(stderr, "master: %s is still migrating\n", migration.country);
+		return;
+	}
+
+	if (m_find_country(name, target)) {
+		fprintf(stderr, "master: %s is at worker %d already\n", name, target);
+		return;
+	}
+
+	for (w = 0; w < workers; ++w) {
+		if (m_find_country(name, w) && (source == -1 ||
+		    m_group(w, workers) == m_group(target, workers)))
+			source = w;
+	}
+
+	if (source == -1) {
+		fprintf(stderr, "master: no such country: %s\n", name);
+		return;
+	}
+
+	if (!(migration.country = strdup(name)))
+		return;
+
+	migration.source = source;
+	migration.target = target;
+
+	printf("Migrating %s: worker %d -> %d\n", name, source, target);
+	fflush(stdout);
+
+	/* The server moves the source's routes to the target (server/route.h) */
+	snprintf(source_tag, sizeof(source_tag), "%d", source);
+
+	msg_write_line(request_fd[target], CMD_LOAD);
+	msg_write_line(request_fd[target], name);
+	msg_write_line(request_fd[target], source_tag);
+	msg_done(request_fd[target]);
+}
+
+/* Target worker: <name> is loaded (and routed to it), or not */
+static void m_migrated(char *name, int target, int loaded, int workers, char *input_dir,
+                       char *server_ip, char *server_port, int *pid, int *request_fd)
+{
+	struct country_entry **entry, *moved;
+	int source = migration.source;
+
+	if (!migration.country || strcmp(migration.country, name) || target != migration.target)
+		return;                                      /* Not ours */
+
+	if (!loaded) {
+		fprintf(stderr, "master: worker %d could not load %s\n", target, name);
+	} else if ((entry = m_find_country(name, source))) {
+		/* Respawns of either worker get the new assignment */
+		moved = *entry;
+		*entry = moved->next;
+
+		moved->next = countries[target];
+		countries[target] = moved;
+
+		msg_write_line(request_fd[source], CMD_DROP);
+		msg_write_line(request_fd[source], name);
+		msg_done(request_fd[source]);
+
+		m_refresh_standby(workers, input_dir, source, server_ip, server_port, pid, request_fd);
+		m_refresh_standby(workers, input_dir, target, server_ip, server_port, pid, request_fd);
+
+		printf("Migrated %s: worker %d -> %d\n", name, source, target);
+		fflush(stdout);
+	}
+
+	free(migration.country);
+	migration.country = NULL;
+}
+
+/* Lines on the control pipe: "migrate <country> <worker>" from the operator,
+ * "loaded|failed <country> <worker>" from workers */
+void m_control(int workers, char *input_dir, char *server_ip, char *server_port, int *pid, int *request_fd)
+{
+	static char buf[1024];
+	static size_t len;
+	char *line, *newline, cmd[16], name[256];
+	ssize_t n;
+	int w;
+
+	while ((n = read(control_fd, buf + len, sizeof(buf) - 1 - len)) > 0)
+		len += n;
+
+	buf[len] = '\0';
+
+	for (line = buf; (newline = strchr(line, '\n')); line = newline + 1) {
+		*newline = '\0';
+
+		if (sscanf(line, "%15s %255s %d", cmd, name, &w) != 3) {
+			if (line[strspn(line, " \t")])
+				fprintf(stderr, "master: %s: expected <command> <country> <worker>\n", line);
+
+			continue;
+		}
+
+		if (!strcmp(cmd, "migrate"))
+			m_migrate(name, w, workers, request_fd);
+		else if (!strcmp(cmd, "loaded") || !strcmp(cmd, "failed"))
+			m_migrated(name, w, !strcmp(cmd, "loaded"), workers, input_dir,
+			           server_ip, server_port, pid, request_fd);
+		else
+			fprintf(stderr, "master: unknown command: %s\n", cmd);
+	}
+
+	/* Keep the unfinished line (unless it can't ever finish) */
+	len -= line - buf;
+	memmove(buf, line, len);
+
+	if (len == sizeof(buf) - 1)
+		len = 0;
+}
+
+int m_exit(char *input_dir, int workers, int *pid, int *request_fd)
 {
 	char path[64];
 	int w;
@@ -222,9 +697,19 @@ int m_exit(char *input_dir, int workers, int *pid)
 		kill(pid[w], SIGKILL);
 		wait(NULL);
 
+		if (request_fd[w] != -1)
+			close(request_fd[w]);
+
 		snprintf(path, sizeof(path), "/tmp/p_request.%d", w);
 		unlink(path);
 
+		if (standby_pid && standby_pid[w] != -1) {
+			kill(standby_pid[w], SIGKILL);
+			waitpid(standby_pid[w], NULL, 0);
+
+			close(standby_fd[w]);
+		}
+
 		/* Free Worker Countries */
 		entry = countries[w];
 
@@ -239,6 +724,12 @@ int m_exit(char *input_dir, int workers, int *pid)
 	}
 
 	free(countries);
+	free(migration.country);
+
+	if (control_fd != -1)
+		close(control_fd);
+
+	unlink(CONTROL_PIPE);
 
 	return DA_OK;
 }
@@ -138,6 +138,36 @@ struct record *record_add(struct record *tmp)
 	return new_record;
 }
 
+/* Unlink and free the records of <country> (the bucket entry's string,
+ * all records point to it). Returns how many */
+int records_drop(char *country)
+{
+	struct record **current, *record;
+	int i, dropped = 0;
+
+	for (i = 0; i < records_ht->entries; ++i) {
+		current = (struct record**) &records_ht->bucket[i];
+
+		while ((record = *current)) {
+			if (record->country != country) {
+				current = &record->next;
+				continue;
+			}
+
+			*current = record->next;
+
+			free(record->record_id);
+			free(record->first_name);
+			free(record->last_name);
+			free(record);
+
+			dropped++;
+		}
+	}
+
+	return dropped;
+}
+
 void records_destroy()
 {
 	struct record *current, *next;
@@ -91,31 +91,49 @@ struct tree_node *tree_insert(struct tree_node *root, struct record *record)
 	return root;
 }
 
+/* First node (in order) with key >= entry_date */
 struct tree_node *tree_find_gte_node(struct tree_node *root, struct date *entry_date)
 {
-	if (!root->left && !root->right &&
-	    datecmp(entry_date, &root->patient_record->entry_date) > 0)
-		return NULL;
-
-	if (datecmp(entry_date, &root->patient_record->entry_date) <= 0) {
-		if (!root->left)
-			return root;
-		else if (datecmp(entry_date, &root->left->patient_record->entry_date) < 0)
-			return root;
+	struct tree_node *gte = NULL;
+
+	while (root) {
+		if (datecmp(entry_date, &root->patient_record->entry_date) <= 0) {
+			gte = root;
+			root = root->left;
+		} else {
+			root = root->right;
+		}
 	}
 
-	if (datecmp(entry_date, &root->patient_record->entry_date) < 0)
-		return tree_find_gte_node(root->left, entry_date);
-	else
-		return tree_find_gte_node(root->right, entry_date);
+	return gte;
+}
+
+/* State of the InOrder Traversal */
+static struct stack_node *stack = NULL;
+static struct tree_node *current;
+
+/* The nodes still to visit are the ones we went left from, on the way
+ * down to the first record >= entry_date (and their right subtrees) */
+struct record *tree_seek(struct tree_node *root, struct date *entry_date)
+{
+	stack_destroy(&stack);
+	current = NULL;
+
+	while (root) {
+		if (datecmp(entry_date, &root->patient_record->entry_date) <= 0) {
+			stack_push(&stack, root);
+			root = root->left;
+		} else {
+			root = root->right;
+		}
+	}
+
+	return tree_get_next_record(NULL);
 }
 
 /* InOrder Traversal, using a stack */
 struct record *tree_get_next_record(struct tree_node *root)
 {
-	static struct stack_node *stack = NULL;
-	static struct tree_node *current;
-
 	struct record *ret;
 
 	if (root) {
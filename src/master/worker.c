@@ -3,6 +3,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,15 +13,42 @@
 #include <unistd.h>
 
 #include "common.h"
+#include "histogram.h"
 #include "master/hashtable.h"
+#include "master/master.h"
 #include "master/tree.h"
 #include "master/worker.h"
 #include "pipes.h"
+#include "trace.h"
 
 /* For length specifier in sscanf */
 #define STR2(x) #x
 #define STR(X) STR2(X)
 
+/* Live metrics, reported by /metrics (and partly by w_exit) */
+static const char *_commands[] = {
+	CMD_LIST_COUNTRIES, CMD_TOPK_AGE_RANGES, CMD_SEARCH_RECORD,
+	CMD_NUM_ADMISSIONS, CMD_NUM_DISCHARGES, CMD_AGGREGATE, CMD_METRICS,
+	"other"
+};
+
+#define W_COMMANDS (sizeof(_commands)/sizeof(_commands[0]))
+
+static struct {
+	int tag;
+	uint64_t start;                                /* histogram_clock() */
+
+	unsigned long files, lines;
+	uint64_t ingest_us;
+
+	int requests_total, requests_ok;
+	struct histogram latency[W_COMMANDS];                 /* Per command */
+} metrics;
+
+/* Server's statistics port, and our port for it to connect to */
+static struct sockaddr_in to_server;
+static in_port_t request_port;
+
 /* Signal stuff */
 static volatile sig_atomic_t check_for_new_files, worker_quit;
 static struct sigaction sigact;
@@ -41,10 +69,16 @@ static void w_sig_handler(int sig, siginfo_t *siginfo, void *context)
 
 /* Declarations */
 /* Phases */
-int w_master_phase(int tag, char *input_dir, int master_pipe);
+int w_master_phase(int tag, char *input_dir, int master_pipe, int standby);
+int w_listen(void);
+int w_standby(int master_pipe, int stats_file);
+int w_send_file(int fd, int sock);
+int w_stats_connect(void);
 int w_directories(char *args, char *input_dir, int response_fd);
 
-int w_cmd_phase(char *input_dir, int request_socket);
+int w_cmd_phase(char *input_dir, int request_socket, int master_pipe);
+int w_query(int request_sock);
+int w_master_request(char *input_dir, int master_pipe, int request_sock);
 int w_exit(char *input_dir, int requests_total, int requests_ok);
 
 int w_insert_from_file(char *country, char *file, int response_fd);
@@ -54,6 +88,11 @@ int w_insert_record(char *country, char *file, char *record);
 int w_topk_age_ranges(char *args, int response_fd);
 int w_search_patient_record(char *args, int response_fd);
 int w_num_patients(enum mode, char *args, int response_fd);
+int w_aggregate(char *args, int response_fd);
+int w_metrics(int response_fd);
+
+/* Live migration */
+int w_load(char *country, char *source, char *input_dir, int request_sock);
 
 int str_datecmp(const struct dirent ** file1, const struct dirent ** file2)
 {
@@ -72,10 +111,17 @@ int str_datefilter(const struct dirent *file)
 }
 
 /* Implementation */
-int worker(int tag, char *input_dir)
+int worker(int tag, char *input_dir, int standby)
 {
 	char path[64];
 	int master_pipe, request_sock;
+	int i;
+
+	metrics.tag = tag;
+	metrics.start = histogram_clock();
+
+	for (i = 0; i < W_COMMANDS; ++i)
+		histogram_init(metrics.latency + i);
 
 	/* Setup Signal Handlers */
 	sigact.sa_sigaction = w_sig_handler;
@@ -86,7 +132,7 @@ int worker(int tag, char *input_dir)
 	ht_init(13, 13, 512);    /* 13 is a nice prime number for the buckets */
 
 	/* Open pipes on worker end */
-	snprintf(path, sizeof(path), "/tmp/p_request.%d", tag);
+	snprintf(path, sizeof(path), standby ? "/tmp/p_standby.%d" : "/tmp/p_request.%d", tag);
 	master_pipe = open(path, O_RDONLY);
 
 	if (master_pipe == -1) {
@@ -94,10 +140,19 @@ int worker(int tag, char *input_dir)
 		exit(DA_PIPE_ERROR);
 	}
 
-	request_sock = w_master_phase(tag, input_dir, master_pipe);
-	w_cmd_phase(input_dir, request_sock);
+	/* A standby retired by the master before it was needed */
+	if ((request_sock = w_master_phase(tag, input_dir, master_pipe, standby)) == -1) {
+		close(master_pipe);
+		ht_destroy();
+		free(input_dir);
+
+		return tag;
+	}
+
+	w_cmd_phase(input_dir, request_sock, master_pipe);
 
 	close(request_sock);
+	close(master_pipe);
 
 	ht_destroy();
 	free(input_dir);
@@ -105,8 +160,10 @@ int worker(int tag, char *input_dir)
 	return tag;                      /* Used from master to replace child */
 }
 
-/* Returns request_sock (CMD IN - from server) */
-int w_master_phase(int tag, char *input_dir, int master_pipe)
+/* Returns request_sock (CMD IN - from server).
+ * Standby: load first, keeping the statistics in a file, and only take the
+ * place of a dead worker once the master says so. -1 if it never does */
+int w_master_phase(int tag, char *input_dir, int master_pipe, int standby)
 {
 	/* Needed to get information from master pipe */
 	struct p_msg msg;
@@ -115,22 +172,18 @@ int w_master_phase(int tag, char *input_dir, int master_pipe)
 
 	/* Needed to open worker's listen() socket */
 	int request_sock;
-	struct sockaddr_in from_server;
-	socklen_t len;
 
 	/* Temporarily needed to send statistics to the server */
 	int stats_sock;
-	struct sockaddr_in to_server;
-	char str[16];
+	FILE *stats_file = NULL;
 
 	msg_init(&msg);
 
+	/* The pipe stays open, for migrations (see w_master_request) */
 	do {
 		msg_read(master_pipe, &msg);
 	} while (strcmp(msg.pos - strlen(MSG_READY) - 1, MSG_READY));
 
-	close(master_pipe);           /* No more requests from master process */
-
 	/* Extract information from master's pipe message */
 	countries = msg.buffer;
 
@@ -143,7 +196,58 @@ int w_master_phase(int tag, char *input_dir, int master_pipe)
 	server_ip = strtok(server_ip, MSG_DELIMITER);
 	server_port = atoi(strtok(NULL, MSG_DELIMITER));
 
-	/* Socket creation - CMD IN (from server) */
+	/* Socket creation - STATISTICS OUT (to server) */
+	to_server.sin_family = AF_INET;
+	to_server.sin_addr.s_addr = inet_addr(server_ip);
+	to_server.sin_port = htons(server_port);
+
+	if (standby) {
+		if (!(stats_file = tmpfile())) {
+			perror("worker: tmpfile()");
+			exit(DA_FILE_ERROR);
+		}
+
+		metrics.ingest_us = histogram_clock();
+		w_directories(countries, input_dir, fileno(stats_file));
+		metrics.ingest_us = histogram_clock() - metrics.ingest_us;
+
+		if (w_standby(master_pipe, fileno(stats_file)) != DA_OK) {
+			fclose(stats_file);
+			return -1;
+		}
+	}
+
+	request_sock = w_listen();
+
+	if ((stats_sock = w_stats_connect()) == -1)
+		exit(DA_SOCK_ERROR);
+
+	if (stats_file) {
+		/* Same statistics as the worker we replace: the server's counts
+		 * stay as they were, and its routes point to us */
+		w_send_file(fileno(stats_file), stats_sock);
+		fclose(stats_file);
+	} else {
+		/* Fill data structures & send statistics */
+		metrics.ingest_us = histogram_clock();
+		w_directories(countries, input_dir, stats_sock);
+		metrics.ingest_us = histogram_clock() - metrics.ingest_us;
+	}
+
+	msg_ready(stats_sock);
+
+	close(stats_sock);                         /* Done sending statistics */
+
+	return request_sock;
+}
+
+/* Socket creation - CMD IN (from server). Sets request_port */
+int w_listen(void)
+{
+	int request_sock;
+	struct sockaddr_in from_server;
+	socklen_t len;
+
 	if ((request_sock = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
 		perror("worker: request socket()");
 		exit(DA_SOCK_ERROR);
@@ -164,44 +268,95 @@ int w_master_phase(int tag, char *input_dir, int master_pipe)
 		exit(DA_SOCK_ERROR);
 	}
 
-	/* Socket creation - STATISTICS OUT (to server) */
+	len = sizeof(from_server);
+	getsockname(request_sock, (struct sockaddr*) &from_server, &len);
+
+	request_port = ntohs(from_server.sin_port);
+
+	return request_sock;
+}
+
+/* Loaded: wait for the master to activate us (CMD_ACTIVATE), then rewind
+ * the statistics. Anything else, or EOF, retires the standby */
+int w_standby(int master_pipe, int stats_file)
+{
+	struct p_msg msg;
+	char *pos;
+	int ret;
+
+	msg_init(&msg);
+
+	while (msg.pos == msg.buffer || msg.pos[-1]) {
+		pos = msg.pos;
+
+		if ((ret = msg_read(master_pipe, &msg)) == -1 && !worker_quit)
+			continue;                                        /* EINTR */
+
+		if (ret != 0 || msg.pos == pos)
+			return DA_PIPE_ERROR;                          /* EOF */
+	}
+
+	if (strncmp(msg.buffer, CMD_ACTIVATE MSG_DELIMITER, strlen(CMD_ACTIVATE) + 1))
+		return DA_PIPE_ERROR;
+
+	if (lseek(stats_file, 0, SEEK_SET) == -1) {
+		perror("worker: lseek()");
+		return DA_FILE_ERROR;
+	}
+
+	return DA_OK;
+}
+
+/* Copy the rest of file <fd> to <sock> */
+int w_send_file(int fd, int sock)
+{
+	char buf[8192];
+	ssize_t n;
+
+	while ((n = read(fd, buf, sizeof(buf))) != 0) {
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+
+			perror("worker: read()");
+			return DA_FILE_ERROR;
+		}
+
+		msg_write(sock, buf, n);
+	}
+
+	return DA_OK;
+}
+
+/* Statistics socket, after the header: worker tag and listening port */
+int w_stats_connect(void)
+{
+	int stats_sock;
+	char str[16];
+
 	if ((stats_sock = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
 		perror("worker: statistics socket()");
-		exit(DA_SOCK_ERROR);
+		return -1;
 	}
 
-	to_server.sin_family = AF_INET;
-	to_server.sin_addr.s_addr = inet_addr(server_ip);
-	to_server.sin_port = htons(server_port);
-
 	if (connect(stats_sock, (struct sockaddr*) &to_server, sizeof(to_server)) == -1) {
 		perror("worker: connect()");
-		exit(DA_SOCK_ERROR);
+		close(stats_sock);
+		return -1;
 	}
 
-	/* Send worker tag and listening port to the server */
-	len = sizeof(from_server);
-	getsockname(request_sock, (struct sockaddr*) &from_server, &len);
-
-	snprintf(str, sizeof(str), "%d" MSG_DELIMITER "%hu",
-	         tag, ntohs(from_server.sin_port));
+	snprintf(str, sizeof(str), "%d" MSG_DELIMITER "%hu", metrics.tag, request_port);
 	msg_write_line(stats_sock, str);
 	msg_done(stats_sock);
 
-	/* Fill data structures & send statistics */
-	w_directories(countries, input_dir, stats_sock);
-
-	msg_ready(stats_sock);
-
-	close(stats_sock);                         /* Done sending statistics */
-
-	return request_sock;
+	return stats_sock;
 }
 
 int w_directories(char *args, char* input_dir, int response_fd)
 {
 	struct dirent **file_list;
 	int n, i;
+	int ret = DA_OK;
 
 	if (chdir(input_dir) == -1) {
 		perror(input_dir);
@@ -213,8 +368,11 @@ int w_directories(char *args, char* input_dir, int response_fd)
 		/* Get files in this directory (args) in date order */
 		n = scandir(args, &file_list, str_datefilter, str_datecmp);
 
-		if (n == -1)
-			return DA_FILE_ERROR;
+		if (n == -1) {
+			perror(args);
+			ret = DA_FILE_ERROR;
+			break;
+		}
 
 		for (i = 0; i < n; ++i) {
 			w_insert_from_file(args, file_list[i]->d_name, response_fd);
@@ -231,79 +389,251 @@ int w_directories(char *args, char* input_dir, int response_fd)
 		return DA_FILE_ERROR;
 	}
 
-	return DA_OK;
+	return ret;
+}
+
+int w_cmd_phase(char *input_dir, int request_sock, int master_pipe)
+{
+	struct pollfd fds[2] = {
+		{request_sock, POLLIN},
+		{master_pipe, POLLIN}
+	};
+
+	/* Loop forever REQ->, handle, RESP-> */
+	while (!worker_quit) {
+		if (poll(fds, 2, -1) == -1) {
+			if (errno == EINTR) {
+				continue;                    /* Check SIGNALS */
+			} else {
+				perror("worker: poll()");
+				exit(DA_SOCK_ERROR);
+			}
+		}
+
+		/* Queries first: those sent before a migration expect the
+		 * countries where they were */
+		if (fds[0].revents & POLLIN)
+			w_query(request_sock);
+		else if (fds[1].revents & POLLIN)
+			w_master_request(input_dir, master_pipe, request_sock);
+		else if (fds[1].revents & (POLLHUP | POLLERR))
+			fds[1].fd = -1;                       /* Master is gone */
+	}
+
+	return w_exit(input_dir, metrics.requests_total, metrics.requests_ok);
 }
 
-int w_cmd_phase(char *input_dir, int request_sock)
+/* Accept a query and answer it. Returns -1 if there was none waiting
+ * (non-blocking <request_sock>) */
+int w_query(int request_sock)
 {
 	int query_fd;                               /* Returned from accept() */
 	struct sockaddr_in from_server;
 	socklen_t len;
 
 	struct p_msg msg;
-	char *cmd, *args;
+	char *cmd, *args, *str;
 	int ret = DA_OK;
 
-	int requests_total = 0, requests_ok = 0;
+	/* Countries the server wants left out of this request */
+	char *excluded[EXCLUDE_MAX];
+	int n, n_excluded;
+
+	uint64_t start;
+	int i;
+
+	struct trace trace;
+	uint64_t trace_start;
 
+	len = sizeof(from_server);
+	query_fd = accept(request_sock, (struct sockaddr*) &from_server, &len);
+
+	if (query_fd == -1) {
+		if (errno == EINTR) {
+			return DA_OK;                /* Check SIGNALS */
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return -1;
+		} else {
+			perror("worker: accept()");
+			exit(DA_SOCK_ERROR);
+		}
+	}
+
+	/* Read request */
 	msg_init(&msg);
+	while (msg_read(query_fd, &msg) == -1 && errno == EINTR) {}
 
-	/* Loop forever REQ->, handle, RESP-> */
-	while (!worker_quit) {
-		len = sizeof(from_server);
-		query_fd = accept(request_sock, (struct sockaddr*) &from_server, &len);
+	start = histogram_clock();
+	trace_start = trace_clock();
 
-		if (query_fd == -1) {
-			if (errno == EINTR) {
-				continue;                    /* Check SIGNALS */
-			} else {
-				perror("worker: accept()");
-				exit(DA_SOCK_ERROR);
+	if (!(cmd = strtok_r(msg.buffer, MSG_DELIMITER, &args))) {
+		close(query_fd);
+		return DA_OK;                              /* Empty input */
+	}
+
+	/* Headers (trace, countries to leave out), then the actual command */
+	trace_init(&trace, NULL);
+	n_excluded = 0;
+
+	while (cmd && (!strcmp(cmd, TRACE_HEADER) || !strcmp(cmd, MSG_EXCLUDE))) {
+		if (!strcmp(cmd, TRACE_HEADER)) {
+			trace_init(&trace, strtok_r(NULL, MSG_DELIMITER, &args));
+		} else {
+			str = strtok_r(NULL, MSG_DELIMITER, &args);
+			n = str ? MIN(atoi(str), EXCLUDE_MAX) : 0;
+
+			for (n_excluded = 0; n_excluded < n; ++n_excluded) {
+				if (!(excluded[n_excluded] = strtok_r(NULL, MSG_DELIMITER, &args)))
+					break;
 			}
 		}
 
-		/* Read request */
-		while (msg_read(query_fd, &msg) == -1 && errno == EINTR) {}
+		cmd = strtok_r(NULL, MSG_DELIMITER, &args);
+	}
 
-		if (!(cmd = strtok_r(msg.buffer, MSG_DELIMITER, &args)))
-			continue;                              /* Empty input */
+	if (!cmd || !strcmp(cmd, CMD_EXIT)) {
+		worker_quit = cmd != NULL;
+		close(query_fd);
+		return DA_OK;
+	}
 
-		ret = DA_INVALID_CMD;
+	ht_exclude_countries(excluded, n_excluded);
+
+	ret = DA_INVALID_CMD;
+
+	/* Depending on the kind of request, handle the request */
+	if (!strcmp(cmd, CMD_LIST_COUNTRIES))          /* Easter egg for nc */
+		ret = list_countries(query_fd);
+	else if (!strcmp(cmd, CMD_TOPK_AGE_RANGES))
+		ret = w_topk_age_ranges(args, query_fd);
+	else if (!strcmp(cmd, CMD_SEARCH_RECORD))
+		ret = w_search_patient_record(args, query_fd);
+	else if (!strcmp(cmd, CMD_NUM_ADMISSIONS))
+		ret = w_num_patients(ENTER, args, query_fd);
+	else if (!strcmp(cmd, CMD_NUM_DISCHARGES))
+		ret = w_num_patients(EXIT, args, query_fd);
+	else if (!strcmp(cmd, CMD_AGGREGATE))
+		ret = w_aggregate(args, query_fd);
+	else if (!strcmp(cmd, CMD_METRICS))
+		ret = w_metrics(query_fd);
+
+	ht_exclude_countries(NULL, 0);
+
+	if (ret == DA_INVALID_CMD) {
+		fprintf(stderr, "Invalid request: %s\n", cmd);
+		msg_invalid(query_fd);
+	}
 
-		/* Depending on the kind of request, handle the request */
-		if (!strcmp(cmd, CMD_EXIT))
-			break;
-		//else if (!strcmp(cmd, CMD_DIRECTORIES))
-			//ret = w_directories(args, input_dir, query_fd);
-		else if (!strcmp(cmd, CMD_LIST_COUNTRIES)) /* Easter egg for nc */
-			ret = list_countries(query_fd);
-		else if (!strcmp(cmd, CMD_TOPK_AGE_RANGES))
-			ret = w_topk_age_ranges(args, query_fd);
-		else if (!strcmp(cmd, CMD_SEARCH_RECORD))
-			ret = w_search_patient_record(args, query_fd);
-		else if (!strcmp(cmd, CMD_NUM_ADMISSIONS))
-			ret = w_num_patients(ENTER, args, query_fd);
-		else if (!strcmp(cmd, CMD_NUM_DISCHARGES))
-			ret = w_num_patients(EXIT, args, query_fd);
-
-		msg.consumed = 1;
-
-		if (ret == DA_INVALID_CMD) {
-			fprintf(stderr, "Invalid request: %s\n", cmd);
-			msg_invalid(query_fd);
-		}
+	msg_ready(query_fd);
 
-		msg_ready(query_fd);
+	metrics.requests_total++;
 
-		requests_total++;
+	if (ret == DA_OK)
+		metrics.requests_ok++;
+
+	/* Last one ("other") catches unknown commands */
+	for (i = 0; i < W_COMMANDS - 1 && strcmp(cmd, _commands[i]); ++i)
+		continue;
+
+	histogram_record(metrics.latency + i, histogram_clock() - start);
+
+	trace_span(&trace, "worker", metrics.tag, trace_start, trace_clock());
+	trace_write(&trace, "worker", cmd);
+
+	close(query_fd);                          /* Done with this query */
+
+	return DA_OK;
+}
+
+/* Live migration (see master.h): messages of a command and a country (and
+ * the worker it moves from, for a load) */
+int w_master_request(char *input_dir, int master_pipe, int request_sock)
+{
+	struct p_msg msg;
+	char *start, *next, *cmd, *country, *source, *saveptr;
+
+	msg_init(&msg);
 
-		if (ret == DA_OK)
-			requests_ok++;
+	if (msg_read(master_pipe, &msg) != 0)
+		return DA_PIPE_ERROR;
 
-		close(query_fd);                      /* Done with this query */
+	for (start = msg.buffer; start < msg.pos; start = next) {
+		next = start + strnlen(start, msg.pos - start) + 1;
+
+		if (!(cmd = strtok_r(start, MSG_DELIMITER, &saveptr)) ||
+		    !(country = strtok_r(NULL, MSG_DELIMITER, &saveptr)))
+			continue;
+
+		source = strtok_r(NULL, MSG_DELIMITER, &saveptr);
+
+		if (!strcmp(cmd, CMD_LOAD))
+			w_load(country, source ? source : "-1", input_dir, request_sock);
+		else if (!strcmp(cmd, CMD_DROP) && ht_drop_country(country) != DA_OK)
+			fprintf(stderr, "worker %d: no %s to drop\n", metrics.tag, country);
 	}
 
-	return w_exit(input_dir, requests_total, requests_ok);
+	return DA_OK;
+}
+
+/* Announce the country to the server, read its files and send their
+ * statistics (as on startup), then tell the master once the server routes
+ * the country here */
+int w_load(char *country, char *source, char *input_dir, int request_sock)
+{
+	char line[512];
+	int stats_sock, control, flags, ret;
+	ssize_t n;
+
+	if ((stats_sock = w_stats_connect()) == -1)
+		return DA_SOCK_ERROR;
+
+	msg_write_line(stats_sock, CMD_LOAD);
+	msg_write_line(stats_sock, country);
+	msg_write_line(stats_sock, source);
+	msg_done(stats_sock);
+
+	/* From its READY on, the server leaves the country out of our queries */
+	do {
+		n = read(stats_sock, line, sizeof(line));
+	} while ((n == -1 && errno == EINTR) || (n > 0 && !memchr(line, '\0', n)));
+
+	/* Queries sent before that don't, so they must be answered before the
+	 * country is in */
+	flags = fcntl(request_sock, F_GETFL, 0);
+	fcntl(request_sock, F_SETFL, flags | O_NONBLOCK);
+
+	while (w_query(request_sock) != -1)
+		continue;
+
+	fcntl(request_sock, F_SETFL, flags);
+
+	ret = w_directories(country, input_dir, stats_sock);
+	msg_ready(stats_sock);
+
+	/* Server closes the connection after the switch */
+	do {
+		n = read(stats_sock, line, sizeof(line));
+	} while (n > 0 || (n == -1 && errno == EINTR));
+
+	close(stats_sock);
+
+	if (ret != DA_OK)
+		ht_drop_country(country);             /* Whatever got in */
+
+	if ((control = open(CONTROL_PIPE, O_WRONLY)) == -1) {
+		perror(CONTROL_PIPE);
+		return DA_PIPE_ERROR;
+	}
+
+	n = snprintf(line, sizeof(line), "%s %s %d\n", ret == DA_OK ? "loaded" : "failed",
+	             country, metrics.tag);
+
+	if (write(control, line, MIN((size_t) n, sizeof(line) - 1)) == -1)
+		perror("worker: write() to master");
+
+	close(control);
+
+	return ret;
 }
 
 int w_insert_from_file(char *country, char *file, int response_fd)
@@ -317,7 +647,11 @@ int w_insert_from_file(char *country, char *file, int response_fd)
 	if (!(records_file = fopen(record, "r")))
 		return DA_FILE_ERROR;
 
+	metrics.files++;
+
 	while (fgets(record, sizeof(record), records_file)) {
+		metrics.lines++;
+
 		if (w_insert_record(country, file, record) != DA_OK)
 			fputs("ERROR\n", stderr);
 	}
@@ -409,7 +743,8 @@ int w_search_patient_record(char *args, int response_fd)
 	if (!(record_id = strtok(args, MSG_DELIMITER)))
 		return DA_INVALID_PARAMETER;
 
-	if (!(patient_record = record_get(record_id)))
+	if (!(patient_record = record_get(record_id)) ||
+	    !ht_country_served(patient_record->country))
 		return DA_INVALID_RECORD;
 
 	/* Because dates are nullified from tmp stage (w_insert_record) */
@@ -456,6 +791,95 @@ int w_num_patients(enum mode mode, char *args, int response_fd)
 		return num_patient_discharges(disease, &date1, &date2, country, response_fd);
 }
 
+/* Typed partial result, always sent (status tells the server what went wrong) */
+int w_aggregate(char *args, int response_fd)
+{
+	struct p_aggregate agg = {DA_INVALID_PARAMETER};
+	char *cmd, *disease, *str_date1, *str_date2, *country;
+	struct date date1, date2;
+	enum mode mode;
+
+	if (!(cmd = strtok(args, MSG_DELIMITER)) ||
+	    !(disease = strtok(NULL, MSG_DELIMITER)) ||
+	    !(str_date1 = strtok(NULL, MSG_DELIMITER)) ||
+	    !(str_date2 = strtok(NULL, MSG_DELIMITER))) {
+		msg_write_aggregate(response_fd, &agg);
+		return DA_INVALID_PARAMETER;
+	}
+
+	if (!strcmp(cmd, CMD_NUM_ADMISSIONS)) {
+		mode = ENTER;
+	} else if (!strcmp(cmd, CMD_NUM_DISCHARGES)) {
+		mode = EXIT;
+	} else {
+		msg_write_aggregate(response_fd, &agg);
+		return DA_INVALID_PARAMETER;
+	}
+
+	date1 = to_date(str_date1);
+	date2 = to_date(str_date2);
+	country = strtok(NULL, MSG_DELIMITER);
+
+	aggregate_patients(mode, disease, &date1, &date2, country, &agg);
+	msg_write_aggregate(response_fd, &agg);
+
+	return agg.status;
+}
+
+/* Prometheus text format, one line per metric, labeled with the worker tag */
+int w_metrics(int response_fd)
+{
+	char buf[sizeof(((struct p_msg*) 0)->buffer)], labels[64];
+	size_t len = 0, size = sizeof(buf);
+	double uptime, ingest;
+	struct ht_stats stats;
+	int i, n;
+
+	ht_get_stats(&stats);
+
+	uptime = (histogram_clock() - metrics.start) / 1e6;
+	ingest = metrics.ingest_us / 1e6;
+
+	n = snprintf(buf, size,
+	             "whoworker_uptime_seconds{worker=\"%d\"} %.3f\n"
+	             "whoworker_requests_total{worker=\"%d\"} %d\n"
+	             "whoworker_requests_failed_total{worker=\"%d\"} %d\n"
+	             "whoworker_ingest_files_total{worker=\"%d\"} %lu\n"
+	             "whoworker_ingest_lines_total{worker=\"%d\"} %lu\n"
+	             "whoworker_ingest_seconds{worker=\"%d\"} %.6f\n"
+	             "whoworker_ingest_lines_per_second{worker=\"%d\"} %.0f\n"
+	             "whoworker_records{worker=\"%d\"} %lu\n"
+	             "whoworker_scans_total{worker=\"%d\"} %lu\n"
+	             "whoworker_records_visited_total{worker=\"%d\"} %lu\n",
+	             metrics.tag, uptime,
+	             metrics.tag, metrics.requests_total,
+	             metrics.tag, metrics.requests_total - metrics.requests_ok,
+	             metrics.tag, metrics.files,
+	             metrics.tag, metrics.lines,
+	             metrics.tag, ingest,
+	             metrics.tag, ingest > 0 ? metrics.lines / ingest : 0,
+	             metrics.tag, stats.records,
+	             metrics.tag, stats.scans,
+	             metrics.tag, stats.visited);
+
+	len = MIN((size_t) n, size - 1);
+
+	for (i = 0; i < W_COMMANDS; ++i) {
+		if (!metrics.latency[i].count)
+			continue;
+
+		snprintf(labels, sizeof(labels), "worker=\"%d\",cmd=\"%s\"",
+		         metrics.tag, _commands[i]);
+
+		n = histogram_format(buf + len, size - len, "whoworker_request_latency_us",
+		                     labels, metrics.latency + i);
+
+		len = MIN(len + n, size - 1);
+	}
+
+	return msg_write(response_fd, buf, len + 1);
+}
+
 int w_exit(char *input_dir, int requests_total, int requests_ok)
 {
 	char path[64];
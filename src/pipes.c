@@ -1,3 +1,4 @@
+#include <arpa/inet.h>
 #include <errno.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -108,3 +109,28 @@ int msg_invalid(int fd)
 {
 	return msg_write(fd, MSG_INVALID, strlen(MSG_INVALID) + 1);
 }
+
+int msg_write_aggregate(int fd, struct p_aggregate *agg)
+{
+	struct p_aggregate net;
+	int i;
+
+	net.status = (int32_t) htonl((uint32_t) agg->status);
+	net.count = htonl(agg->count);
+
+	for (i = 0; i < 4; ++i)
+		net.age_group[i] = htonl(agg->age_group[i]);
+
+	return msg_write(fd, (char*) &net, sizeof(net));
+}
+
+void msg_decode_aggregate(struct p_aggregate *agg)
+{
+	int i;
+
+	agg->status = (int32_t) ntohl((uint32_t) agg->status);
+	agg->count = ntohl(agg->count);
+
+	for (i = 0; i < 4; ++i)
+		agg->age_group[i] = ntohl(agg->age_group[i]);
+}
@@ -0,0 +1,370 @@
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "pipes.h"
+#include "server/cube.h"
+
+#define CUBE_BUCKETS 64
+
+/* Cases of a disease in a country, for every day that has a file.
+ * sum[i] holds the prefix sums (all days up to and including day[i]) */
+struct series {
+	struct series *next;
+	char *disease;
+	int days;
+	int capacity;
+	int *day;                                       /* YYYYMMDD, ascending */
+	unsigned (*cases)[4];
+	long (*sum)[4];
+};
+
+struct country {
+	struct country *next;
+	char *name;
+	int tag;                                 /* Worker owning the country */
+	struct series *series;
+};
+
+static struct country *countries[CUBE_BUCKETS];
+static pthread_rwlock_t cube_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Per worker tag: statistics fully received (1) or not (0) */
+static int *worker_ready;
+static int workers;
+
+static int cube_hash(const char *_str)
+{
+	unsigned long hash = 5381;
+	const unsigned char *str = (const unsigned char*) _str;
+	int c;
+
+	while ((c = *str++))
+		hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+
+	return (int) (hash % CUBE_BUCKETS);
+}
+
+void cube_init(void)
+{
+	int i;
+
+	for (i = 0; i < CUBE_BUCKETS; ++i)
+		countries[i] = NULL;
+
+	worker_ready = NULL;
+	workers = 0;
+}
+
+void cube_destroy(void)
+{
+	struct country *country, *next_country;
+	struct series *series, *next_series;
+	int i;
+
+	for (i = 0; i < CUBE_BUCKETS; ++i) {
+		country = countries[i];
+
+		while (country) {
+			next_country = country->next;
+
+			series = country->series;
+			while (series) {
+				next_series = series->next;
+
+				free(series->disease);
+				free(series->day);
+				free(series->cases);
+				free(series->sum);
+				free(series);
+
+				series = next_series;
+			}
+
+			free(country->name);
+			free(country);
+
+			country = next_country;
+		}
+
+		countries[i] = NULL;
+	}
+
+	free(worker_ready);
+	worker_ready = NULL;
+	workers = 0;
+}
+
+void cube_worker_begin(int tag)
+{
+	int *tmp;
+
+	if (tag < 0)
+		return;
+
+	pthread_rwlock_wrlock(&cube_lock);
+
+	if (tag >= workers) {
+		if ((tmp = realloc(worker_ready, (tag + 1) * sizeof(worker_ready[0])))) {
+			worker_ready = tmp;
+
+			while (workers <= tag)
+				worker_ready[workers++] = 0;
+		}
+	}
+
+	if (tag < workers)
+		worker_ready[tag] = 0;
+
+	pthread_rwlock_unlock(&cube_lock);
+}
+
+void cube_worker_ready(int tag)
+{
+	pthread_rwlock_wrlock(&cube_lock);
+
+	if (tag >= 0 && tag < workers)
+		worker_ready[tag] = 1;
+
+	pthread_rwlock_unlock(&cube_lock);
+}
+
+int cube_day(const char *str)
+{
+	int i, day, month, year;
+
+	if (strlen(str) != 10 || str[2] != '-' || str[5] != '-')
+		return -1;
+
+	for (i = 0; i < 10; ++i) {
+		if (i != 2 && i != 5 && !isdigit((unsigned char) str[i]))
+			return -1;
+	}
+
+	day = (str[0] - '0') * 10 + (str[1] - '0');
+	month = (str[3] - '0') * 10 + (str[4] - '0');
+	year = atoi(str + 6);
+
+	/* Same checks as the workers */
+	if (month > 12 || day > 31)
+		return -1;
+
+	return year * 10000 + month * 100 + day;
+}
+
+/* Call with the lock held */
+static struct country *find_country(const char *name)
+{
+	struct country *country = countries[cube_hash(name)];
+
+	while (country && strcmp(country->name, name))
+		country = country->next;
+
+	return country;
+}
+
+static struct series *find_series(struct country *country, const char *disease)
+{
+	struct series *series = country->series;
+
+	while (series && strcmp(series->disease, disease))
+		series = series->next;
+
+	return series;
+}
+
+/* Index of the first day >= <day> */
+static int series_search(struct series *series, int day)
+{
+	int low = 0, high = series->days, mid;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+
+		if (series->day[mid] < day)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+static int series_set(struct series *series, int day, unsigned *cases)
+{
+	int i = series_search(series, day), g;
+	int capacity;
+	void *tmp;
+
+	if (i == series->days || series->day[i] != day) {
+		/* No need to store a day without cases */
+		if (!(cases[0] | cases[1] | cases[2] | cases[3]))
+			return DA_OK;
+
+		if (series->days == series->capacity) {
+			capacity = series->capacity ? 2 * series->capacity : 16;
+
+			if (!(tmp = realloc(series->day, capacity * sizeof(series->day[0]))))
+				return DA_ALLOCATION_ERROR;
+			series->day = tmp;
+
+			if (!(tmp = realloc(series->cases, capacity * sizeof(series->cases[0]))))
+				return DA_ALLOCATION_ERROR;
+			series->cases = tmp;
+
+			if (!(tmp = realloc(series->sum, capacity * sizeof(series->sum[0]))))
+				return DA_ALLOCATION_ERROR;
+			series->sum = tmp;
+
+			series->capacity = capacity;
+		}
+
+		/* Files usually come in date order, so this is mostly a no-op */
+		memmove(series->day + i + 1, series->day + i,
+		        (series->days - i) * sizeof(series->day[0]));
+		memmove(series->cases + i + 1, series->cases + i,
+		        (series->days - i) * sizeof(series->cases[0]));
+
+		series->day[i] = day;
+		series->days++;
+	}
+
+	memcpy(series->cases[i], cases, sizeof(series->cases[0]));
+
+	/* Prefix sums from this day onwards */
+	for (; i < series->days; ++i) {
+		for (g = 0; g < 4; ++g)
+			series->sum[i][g] = (i ? series->sum[i - 1][g] : 0) + series->cases[i][g];
+	}
+
+	return DA_OK;
+}
+
+int cube_add_statistics(int tag, char *msg)
+{
+	struct country *country;
+	struct series *series;
+
+	char *file, *name, *disease, *line, *saveptr;
+	unsigned cases[4];
+	int day, g, hash;
+	int ret = DA_OK;
+
+	if (!(file = strtok_r(msg, MSG_DELIMITER, &saveptr)) || (day = cube_day(file)) < 0)
+		return DA_INVALID_DATE;
+
+	if (!(name = strtok_r(NULL, MSG_DELIMITER, &saveptr)))
+		return DA_INVALID_COUNTRY;
+
+	pthread_rwlock_wrlock(&cube_lock);
+
+	if (!(country = find_country(name))) {
+		if (!(country = calloc(1, sizeof(*country)))) {
+			pthread_rwlock_unlock(&cube_lock);
+			return DA_ALLOCATION_ERROR;
+		}
+
+		country->name = strdup(name);
+
+		hash = cube_hash(name);
+		country->next = countries[hash];
+		countries[hash] = country;
+	}
+
+	country->tag = tag;
+
+	/* Disease, then a line per age group */
+	while (ret == DA_OK && (disease = strtok_r(NULL, MSG_DELIMITER, &saveptr))) {
+		for (g = 0; g < 4; ++g) {
+			line = strtok_r(NULL, MSG_DELIMITER, &saveptr);
+
+			if (!line || sscanf(line, "Age range %*s years: %u cases", cases + g) != 1)
+				break;
+		}
+
+		if (g < 4) {
+			ret = DA_INVALID_RECORD;
+			break;
+		}
+
+		if (!(series = find_series(country, disease))) {
+			if (!(cases[0] | cases[1] | cases[2] | cases[3]))
+				continue;
+
+			if (!(series = calloc(1, sizeof(*series)))) {
+				ret = DA_ALLOCATION_ERROR;
+				break;
+			}
+
+			series->disease = strdup(disease);
+			series->next = country->series;
+			country->series = series;
+		}
+
+		ret = series_set(series, day, cases);
+	}
+
+	pthread_rwlock_unlock(&cube_lock);
+
+	return ret;
+}
+
+/* Add the cases of <series> in [day1, day2] to <age_group> */
+static void series_add(struct series *series, int day1, int day2, long *age_group)
+{
+	int i = series_search(series, day1);
+	int j = series_search(series, day2 + 1);
+	int g;
+
+	if (i == j)
+		return;
+
+	for (g = 0; g < 4; ++g)
+		age_group[g] += series->sum[j - 1][g] - (i ? series->sum[i - 1][g] : 0);
+}
+
+int cube_admissions(char *disease, char *country, int day1, int day2, long *count, long *age_group)
+{
+	struct country *entry;
+	struct series *series;
+	int i, ret = DA_OK;
+
+	memset(age_group, 0, 4 * sizeof(age_group[0]));
+
+	pthread_rwlock_rdlock(&cube_lock);
+
+	if (country) {
+		/* Only the worker owning the country needs to be done */
+		if (!(entry = find_country(country)) ||
+		    entry->tag >= workers || !worker_ready[entry->tag]) {
+			ret = DA_INVALID_COUNTRY;
+		} else if ((series = find_series(entry, disease))) {
+			series_add(series, day1, day2, age_group);
+		}
+	} else {
+		/* All countries: every worker we know of must be done */
+		if (!workers)
+			ret = DA_INVALID_PARAMETER;
+
+		for (i = 0; i < workers; ++i) {
+			if (!worker_ready[i])
+				ret = DA_INVALID_PARAMETER;
+		}
+
+		for (i = 0; ret == DA_OK && i < CUBE_BUCKETS; ++i) {
+			for (entry = countries[i]; entry; entry = entry->next) {
+				if ((series = find_series(entry, disease)))
+					series_add(series, day1, day2, age_group);
+			}
+		}
+	}
+
+	pthread_rwlock_unlock(&cube_lock);
+
+	*count = age_group[0] + age_group[1] + age_group[2] + age_group[3];
+
+	return ret;
+}
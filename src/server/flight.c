@@ -0,0 +1,160 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "server/flight.h"
+
+#define FLIGHT_BUCKETS 64
+
+struct flight {
+	struct flight *next;               /* Forms the list of the bucket */
+	char *key;
+	int refs;
+	int landed;
+	int ret;
+	char *response;
+	size_t len;
+	pthread_cond_t cond;
+};
+
+static struct flight *flights[FLIGHT_BUCKETS];
+static pthread_mutex_t flight_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char _whitespace[] = " \f\n\r\t\v";
+
+static int flight_hash(const char *_str)
+{
+	unsigned long hash = 5381;
+	const unsigned char *str = (const unsigned char*) _str;
+	int c;
+
+	while ((c = *str++))
+		hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+
+	return (int) (hash % FLIGHT_BUCKETS);
+}
+
+void flight_key(char *key, size_t size, const char *query)
+{
+	size_t len = 0, n;
+
+	while (len < size - 1) {
+		query += strspn(query, _whitespace);
+
+		if (!(n = strcspn(query, _whitespace)))
+			break;
+
+		if (len)
+			key[len++] = ' ';
+
+		n = MIN(n, size - 1 - len);
+		memcpy(key + len, query, n);
+
+		len += n;
+		query += n;
+	}
+
+	key[len] = '\0';
+}
+
+struct flight *flight_join(const char *key, int *leader)
+{
+	struct flight *flight;
+	int hash = flight_hash(key);
+
+	pthread_mutex_lock(&flight_mutex);
+
+	for (flight = flights[hash]; flight; flight = flight->next) {
+		if (!flight->landed && !strcmp(flight->key, key))
+			break;
+	}
+
+	if (flight) {
+		flight->refs++;
+		*leader = 0;
+	} else if ((flight = calloc(1, sizeof(*flight)))) {
+		flight->key = strdup(key);
+		flight->refs = 1;
+		pthread_cond_init(&flight->cond, NULL);
+
+		flight->next = flights[hash];
+		flights[hash] = flight;
+
+		*leader = 1;
+	} else {
+		*leader = 1;                  /* Can't coalesce, just run it */
+	}
+
+	pthread_mutex_unlock(&flight_mutex);
+
+	return flight;
+}
+
+void flight_land(struct flight *flight, const char *response, size_t len, int ret)
+{
+	struct flight **f;
+
+	if (!flight)
+		return;
+
+	pthread_mutex_lock(&flight_mutex);
+
+	/* No response: followers have to run the query themselves */
+	if (response && (flight->response = malloc(len ? len : 1))) {
+		memcpy(flight->response, response, len);
+		flight->len = len;
+	}
+
+	flight->ret = ret;
+	flight->landed = 1;
+
+	/* Unlink: queries arriving from now on start a new flight */
+	for (f = &flights[flight_hash(flight->key)]; *f; f = &(*f)->next) {
+		if (*f == flight) {
+			*f = flight->next;
+			break;
+		}
+	}
+
+	pthread_cond_broadcast(&flight->cond);
+	pthread_mutex_unlock(&flight_mutex);
+}
+
+int flight_wait(struct flight *flight, const char **response, size_t *len)
+{
+	int ret;
+
+	pthread_mutex_lock(&flight_mutex);
+
+	while (!flight->landed)
+		pthread_cond_wait(&flight->cond, &flight_mutex);
+
+	*response = flight->response;
+	*len = flight->len;
+	ret = flight->ret;
+
+	pthread_mutex_unlock(&flight_mutex);
+
+	return ret;
+}
+
+void flight_leave(struct flight *flight)
+{
+	int refs;
+
+	if (!flight)
+		return;
+
+	pthread_mutex_lock(&flight_mutex);
+	refs = --flight->refs;
+	pthread_mutex_unlock(&flight_mutex);
+
+	if (refs)
+		return;
+
+	pthread_cond_destroy(&flight->cond);
+	free(flight->response);
+	free(flight->key);
+	free(flight);
+}
@@ -0,0 +1,220 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "server/log.h"
+
+#define LOG_IDLE_NS 1000000                         /* Writer naps for 1ms */
+
+/* Records: length (uint32_t), then the data. head and tail only increase;
+ * their difference is the space in use */
+struct log_ring {
+	char *buffer;
+	size_t size;                                          /* Power of 2 */
+	atomic_size_t head;                              /* Producer's side */
+	atomic_size_t tail;                              /* Consumer's side */
+	atomic_ulong dropped;
+};
+
+static struct log_ring *rings;
+static int n_rings;
+static atomic_int attached;
+
+static atomic_ulong queries;
+static int sampling;
+
+static pthread_t writer;
+static atomic_int writer_quit;
+
+static _Thread_local struct log_ring *own_ring;      /* Calling thread's */
+
+void *log_writer(void *args);
+
+int log_init(int _rings, size_t ring_size, int _sampling)
+{
+	size_t size = 1024;
+	int i;
+
+	while (size < ring_size)
+		size *= 2;
+
+	if (!(rings = calloc(_rings, sizeof(rings[0]))))
+		return DA_ALLOCATION_ERROR;
+
+	for (i = 0; i < _rings; ++i) {
+		if (!(rings[i].buffer = malloc(size)))
+			return DA_ALLOCATION_ERROR;
+
+		rings[i].size = size;
+		atomic_init(&rings[i].head, 0);
+		atomic_init(&rings[i].tail, 0);
+		atomic_init(&rings[i].dropped, 0);
+	}
+
+	n_rings = _rings;
+	atomic_init(&attached, 0);
+
+	sampling = MAX(_sampling, 1);
+	atomic_init(&queries, 0);
+
+	atomic_init(&writer_quit, 0);
+
+	if (pthread_create(&writer, NULL, log_writer, NULL))
+		return DA_ALLOCATION_ERROR;
+
+	return DA_OK;
+}
+
+int log_attach(void)
+{
+	int i = atomic_fetch_add(&attached, 1);
+
+	if (i >= n_rings)
+		return DA_INVALID_PARAMETER;
+
+	own_ring = rings + i;
+
+	return DA_OK;
+}
+
+int log_sample(void)
+{
+	return !(atomic_fetch_add(&queries, 1) % sampling);
+}
+
+/* Copy, wrapping around the end of the buffer */
+static void ring_put(struct log_ring *ring, size_t pos, const char *buf, size_t nbyte)
+{
+	size_t offset = pos & (ring->size - 1);
+	size_t first = MIN(nbyte, ring->size - offset);
+
+	memcpy(ring->buffer + offset, buf, first);
+	memcpy(ring->buffer, buf + first, nbyte - first);
+}
+
+static void ring_get(struct log_ring *ring, size_t pos, char *buf, size_t nbyte)
+{
+	size_t offset = pos & (ring->size - 1);
+	size_t first = MIN(nbyte, ring->size - offset);
+
+	memcpy(buf, ring->buffer + offset, first);
+	memcpy(buf + first, ring->buffer, nbyte - first);
+}
+
+int log_write(const char *buf, size_t nbyte)
+{
+	struct log_ring *ring = own_ring;
+	size_t head, tail;
+	uint32_t len = nbyte;
+
+	if (!ring)
+		return DA_INVALID_PARAMETER;
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	if (ring->size - (head - tail) < sizeof(len) + nbyte) {
+		atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+		return DA_ALLOCATION_ERROR;
+	}
+
+	ring_put(ring, head, (char*) &len, sizeof(len));
+	ring_put(ring, head + sizeof(len), buf, nbyte);
+
+	atomic_store_explicit(&ring->head, head + sizeof(len) + nbyte, memory_order_release);
+
+	return DA_OK;
+}
+
+unsigned long log_dropped(void)
+{
+	unsigned long dropped = 0;
+	int i;
+
+	for (i = 0; i < n_rings; ++i)
+		dropped += atomic_load_explicit(&rings[i].dropped, memory_order_relaxed);
+
+	return dropped;
+}
+
+/* Write out everything logged so far. Returns the amount of bytes */
+static size_t log_drain(char *out, size_t size)
+{
+	struct log_ring *ring;
+	size_t head, tail, total = 0;
+	uint32_t len;
+	int i;
+
+	for (i = 0; i < n_rings; ++i) {
+		ring = rings + i;
+
+		tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+		while (tail != head) {
+			ring_get(ring, tail, (char*) &len, sizeof(len));
+
+			/* Records never exceed the ring, so they fit in <out> */
+			ring_get(ring, tail + sizeof(len), out, len);
+			fwrite(out, len, 1, stdout);
+
+			tail += sizeof(len) + len;
+			total += len;
+		}
+
+		atomic_store_explicit(&ring->tail, tail, memory_order_release);
+	}
+
+	if (total)
+		fflush(stdout);
+
+	return total;
+}
+
+void *log_writer(void *args)
+{
+	struct timespec idle = {0, LOG_IDLE_NS};
+	unsigned long dropped, reported = 0;
+	size_t size = rings ? rings[0].size : 0;
+	char *out = malloc(size);
+
+	if (!out)
+		return (void*) DA_ALLOCATION_ERROR;
+
+	while (!atomic_load(&writer_quit)) {
+		if (!log_drain(out, size))
+			nanosleep(&idle, NULL);
+
+		if ((dropped = log_dropped()) != reported) {
+			fprintf(stdout, "[log: %lu lines dropped]\n", dropped - reported);
+			fflush(stdout);
+
+			reported = dropped;
+		}
+	}
+
+	log_drain(out, size);
+	free(out);
+
+	return (void*) DA_OK;
+}
+
+void log_destroy(void)
+{
+	int i;
+
+	atomic_store(&writer_quit, 1);
+	pthread_join(writer, NULL);
+
+	for (i = 0; i < n_rings; ++i)
+		free(rings[i].buffer);
+
+	free(rings);
+	rings = NULL;
+	n_rings = 0;
+}
@@ -16,10 +16,11 @@ int main(int argc, char *argv[])
 	int opt;
 	int query_port = 0, statistics_port = 0;
 	int n_threads = 0, buffer_size = 0;
+	struct server_options options = {.verbosity = 2, .sampling = 1};
 
 	in_port_t q_port, s_port;
 
-	while ((opt = getopt(argc, argv, "q:s:w:b:")) != -1) {
+	while ((opt = getopt(argc, argv, "q:s:w:b:v:S:T:")) != -1) {
 		switch (opt) {
 		case 'q':
 			query_port = atoi(optarg);
@@ -37,6 +38,18 @@ int main(int argc, char *argv[])
 			buffer_size = atoi(optarg);
 			break;
 
+		case 'v':
+			options.verbosity = atoi(optarg);
+			break;
+
+		case 'S':
+			options.sampling = atoi(optarg);
+			break;
+
+		case 'T':
+			options.slow_ms = atoi(optarg);
+			break;
+
 		default:
 			return print_usage(argv[0]);
 		}
@@ -53,13 +66,13 @@ int main(int argc, char *argv[])
 	s_port = htons((in_port_t) statistics_port);
 
 	/* The magic begins... */
-	return server(q_port, s_port, n_threads, buffer_size);
+	return server(q_port, s_port, n_threads, buffer_size, &options);
 }
 
 
 int print_usage(const char *program)
 {
-	fprintf(stderr, "%s –q queryPortNum -s statisticsPortNum –w numThreads –b bufferSize\n",
+	fprintf(stderr, "%s –q queryPortNum -s statisticsPortNum –w numThreads –b bufferSize [-v verbosity] [-S sampling] [-T slowQueryMs]\n",
 	        program);
 	return DA_INVALID_PARAMETER;
 }
@@ -0,0 +1,279 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "histogram.h"
+#include "pipes.h"
+#include "server/log.h"
+#include "server/metrics.h"
+
+static const char *_commands[] = {
+	CMD_DISEASE_FREQUENCY, CMD_TOPK_AGE_RANGES, CMD_SEARCH_RECORD,
+	CMD_NUM_ADMISSIONS, CMD_NUM_DISCHARGES, CMD_METRICS,
+	"other"
+};
+
+#define COMMANDS (sizeof(_commands)/sizeof(_commands[0]))
+
+static const char *_sources[SOURCES] = {"workers", "cube", "coalesced"};
+static const char *_ports[PORTS] = {"statistics", "query"};
+
+struct worker_metrics {
+	struct histogram rtt;
+	unsigned long timeouts;
+	unsigned long errors;
+	uint64_t ready;            /* When its statistics were done, 0: not yet */
+};
+
+struct metrics {
+	uint64_t start;
+
+	unsigned long accepted[PORTS];
+	int active;
+
+	int depth;
+	struct histogram depths;
+	struct histogram wait;
+
+	unsigned long queries[COMMANDS][SOURCES];
+	unsigned long errors[COMMANDS];
+	struct histogram latency[COMMANDS];
+
+	int workers;
+	struct worker_metrics *worker;
+};
+
+static struct metrics metrics;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void metrics_init(void)
+{
+	int i;
+
+	memset(&metrics, 0, sizeof(metrics));
+	metrics.start = histogram_clock();
+
+	histogram_init(&metrics.depths);
+	histogram_init(&metrics.wait);
+
+	for (i = 0; i < COMMANDS; ++i)
+		histogram_init(metrics.latency + i);
+}
+
+void metrics_destroy(void)
+{
+	free(metrics.worker);
+	metrics.worker = NULL;
+	metrics.workers = 0;
+}
+
+void metrics_accept(enum metrics_port port)
+{
+	pthread_mutex_lock(&mutex);
+	metrics.accepted[port]++;
+	pthread_mutex_unlock(&mutex);
+}
+
+void metrics_active(int delta)
+{
+	pthread_mutex_lock(&mutex);
+	metrics.active += delta;
+	pthread_mutex_unlock(&mutex);
+}
+
+void metrics_queue_push(int depth)
+{
+	pthread_mutex_lock(&mutex);
+	metrics.depth = depth;
+	histogram_record(&metrics.depths, depth);
+	pthread_mutex_unlock(&mutex);
+}
+
+void metrics_queue_pop(int depth, uint64_t wait)
+{
+	pthread_mutex_lock(&mutex);
+	metrics.depth = depth;
+	histogram_record(&metrics.wait, wait);
+	pthread_mutex_unlock(&mutex);
+}
+
+void metrics_query(const char *cmd, enum metrics_source source, int ret, uint64_t latency)
+{
+	int i;
+
+	/* Last one ("other") catches unknown commands */
+	for (i = 0; i < COMMANDS - 1 && (!cmd || strcmp(cmd, _commands[i])); ++i)
+		continue;
+
+	pthread_mutex_lock(&mutex);
+
+	metrics.queries[i][source]++;
+
+	if (ret != DA_OK)
+		metrics.errors[i]++;
+
+	histogram_record(metrics.latency + i, latency);
+
+	pthread_mutex_unlock(&mutex);
+}
+
+/* Call with the mutex locked. NULL if out of memory */
+static struct worker_metrics *get_worker(int tag)
+{
+	struct worker_metrics *tmp;
+	int w;
+
+	if (tag < 0)
+		return NULL;
+
+	if (tag >= metrics.workers) {
+		if (!(tmp = realloc(metrics.worker, (tag + 1) * sizeof(tmp[0]))))
+			return NULL;
+
+		for (w = metrics.workers; w <= tag; ++w) {
+			histogram_init(&tmp[w].rtt);
+			tmp[w].timeouts = 0;
+			tmp[w].errors = 0;
+			tmp[w].ready = 0;
+		}
+
+		metrics.worker = tmp;
+		metrics.workers = tag + 1;
+	}
+
+	return metrics.worker + tag;
+}
+
+void metrics_worker_ready(int tag)
+{
+	struct worker_metrics *worker;
+
+	pthread_mutex_lock(&mutex);
+
+	if ((worker = get_worker(tag)))
+		worker->ready = histogram_clock();
+
+	pthread_mutex_unlock(&mutex);
+}
+
+void metrics_worker_rtt(int tag, uint64_t rtt)
+{
+	struct worker_metrics *worker;
+
+	pthread_mutex_lock(&mutex);
+
+	if ((worker = get_worker(tag)))
+		histogram_record(&worker->rtt, rtt);
+
+	pthread_mutex_unlock(&mutex);
+}
+
+void metrics_worker_timeout(int tag)
+{
+	struct worker_metrics *worker;
+
+	pthread_mutex_lock(&mutex);
+
+	if ((worker = get_worker(tag)))
+		worker->timeouts++;
+
+	pthread_mutex_unlock(&mutex);
+}
+
+void metrics_worker_error(int tag)
+{
+	struct worker_metrics *worker;
+
+	pthread_mutex_lock(&mutex);
+
+	if ((worker = get_worker(tag)))
+		worker->errors++;
+
+	pthread_mutex_unlock(&mutex);
+}
+
+int metrics_report(struct reply *reply)
+{
+	struct metrics *snap;
+	char buf[2048], labels[128];
+	int i, s, n, ready = 0;
+
+	/* Take a snapshot, not to hold the lock while writing to the client */
+	if (!(snap = malloc(sizeof(*snap))))
+		return DA_ALLOCATION_ERROR;
+
+	pthread_mutex_lock(&mutex);
+
+	*snap = metrics;
+	snap->worker = malloc(MAX(snap->workers, 1) * sizeof(snap->worker[0]));
+
+	if (snap->worker)
+		memcpy(snap->worker, metrics.worker, snap->workers * sizeof(snap->worker[0]));
+	else
+		snap->workers = 0;
+
+	pthread_mutex_unlock(&mutex);
+
+	reply_printf(reply, "whoserver_uptime_seconds %.3f\n",
+	             (histogram_clock() - snap->start) / 1e6);
+
+	for (i = 0; i < PORTS; ++i)
+		reply_printf(reply, "whoserver_connections_total{port=\"%s\"} %lu\n",
+		             _ports[i], snap->accepted[i]);
+
+	reply_printf(reply, "whoserver_connections_active %d\n", snap->active);
+	reply_printf(reply, "whoserver_queue_depth %d\n", snap->depth);
+
+	n = histogram_format(buf, sizeof(buf), "whoserver_queue_depth_observed", "", &snap->depths);
+	reply_write(reply, buf, MIN((size_t) n, sizeof(buf) - 1));
+
+	n = histogram_format(buf, sizeof(buf), "whoserver_queue_wait_us", "", &snap->wait);
+	reply_write(reply, buf, MIN((size_t) n, sizeof(buf) - 1));
+
+	for (i = 0; i < COMMANDS; ++i) {
+		if (!snap->latency[i].count)
+			continue;
+
+		for (s = 0; s < SOURCES; ++s)
+			reply_printf(reply, "whoserver_queries_total{cmd=\"%s\",source=\"%s\"} %lu\n",
+			             _commands[i], _sources[s], snap->queries[i][s]);
+
+		reply_printf(reply, "whoserver_query_errors_total{cmd=\"%s\"} %lu\n",
+		             _commands[i], snap->errors[i]);
+
+		snprintf(labels, sizeof(labels), "cmd=\"%s\"", _commands[i]);
+		n = histogram_format(buf, sizeof(buf), "whoserver_query_latency_us", labels,
+		                     snap->latency + i);
+		reply_write(reply, buf, MIN((size_t) n, sizeof(buf) - 1));
+	}
+
+	for (i = 0; i < snap->workers; ++i)
+		ready += snap->worker[i].ready != 0;
+
+	reply_printf(reply, "whoserver_workers_ready %d\n", ready);
+
+	for (i = 0; i < snap->workers; ++i) {
+		if (snap->worker[i].ready)
+			reply_printf(reply, "whoserver_worker_ready_seconds{worker=\"%d\"} %.3f\n",
+			             i, (snap->worker[i].ready - snap->start) / 1e6);
+
+		reply_printf(reply, "whoserver_worker_timeouts_total{worker=\"%d\"} %lu\n",
+		             i, snap->worker[i].timeouts);
+		reply_printf(reply, "whoserver_worker_errors_total{worker=\"%d\"} %lu\n",
+		             i, snap->worker[i].errors);
+
+		snprintf(labels, sizeof(labels), "worker=\"%d\"", i);
+		n = histogram_format(buf, sizeof(buf), "whoserver_worker_rtt_us", labels,
+		                     &snap->worker[i].rtt);
+		reply_write(reply, buf, MIN((size_t) n, sizeof(buf) - 1));
+	}
+
+	reply_printf(reply, "whoserver_log_dropped_total %lu\n", log_dropped());
+
+	free(snap->worker);
+	free(snap);
+
+	return DA_OK;
+}
@@ -4,6 +4,7 @@
 
 struct ring_buffer {
 	int *buffer;
+	uint64_t *stamp;
 	size_t head;
 	size_t tail;
 	size_t capacity;
@@ -16,6 +17,7 @@ struct ring_buffer *make_r_buf(size_t capacity)
 
 	if (r_buf) {
 		r_buf->buffer = malloc(capacity * sizeof(r_buf->buffer[0]));
+		r_buf->stamp = malloc(capacity * sizeof(r_buf->stamp[0]));
 		r_buf->capacity = capacity;
 		r_buf->head = 0;
 		r_buf->tail = 0;
@@ -35,11 +37,20 @@ int r_buf_empty(struct ring_buffer *r_buf)
 	return (!r_buf->full && r_buf->head == r_buf->tail);
 }
 
-void r_buf_push(struct ring_buffer *r_buf, int data)
+size_t r_buf_count(struct ring_buffer *r_buf)
+{
+	if (r_buf->full)
+		return r_buf->capacity;
+
+	return (r_buf->head + r_buf->capacity - r_buf->tail) % r_buf->capacity;
+}
+
+void r_buf_push(struct ring_buffer *r_buf, int data, uint64_t stamp)
 {
 	if (r_buf->full)
 		return;
 
+	r_buf->stamp[r_buf->head] = stamp;
 	r_buf->buffer[r_buf->head++] = data;
 
 	if (r_buf->head >= r_buf->capacity)
@@ -48,13 +59,16 @@ void r_buf_push(struct ring_buffer *r_buf, int data)
 	r_buf->full = (r_buf->head == r_buf->tail);
 }
 
-int r_buf_pop(struct ring_buffer *r_buf)
+int r_buf_pop(struct ring_buffer *r_buf, uint64_t *stamp)
 {
 	int data;
 
 	if (r_buf_empty(r_buf))
 		return -1;
 
+	if (stamp)
+		*stamp = r_buf->stamp[r_buf->tail];
+
 	data = r_buf->buffer[r_buf->tail++];
 
 	if (r_buf->tail >= r_buf->capacity)
@@ -73,5 +87,6 @@ int r_buf_peek(struct ring_buffer *r_buf)
 void r_buf_destroy(struct ring_buffer *r_buf)
 {
 	free(r_buf->buffer);
+	free(r_buf->stamp);
 	free(r_buf);
 }
@@ -0,0 +1,122 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "pipes.h"
+#include "server/reply.h"
+
+static const char _truncated[] = "[...]\n";
+
+void reply_init(struct reply *reply, int client_fd, int capture, char *log, size_t log_size)
+{
+	reply->client_fd = client_fd;
+
+	reply->capture = NULL;
+	reply->len = 0;
+	reply->size = 0;
+	reply->overflow = !capture;
+
+	reply->log = log;
+	reply->log_len = 0;
+	reply->log_size = log ? log_size : 0;
+	reply->truncated = 0;
+
+	if (log && log_size)
+		log[0] = '\0';
+}
+
+static void reply_capture(struct reply *reply, const char *buf, size_t nbyte)
+{
+	size_t size;
+	char *tmp;
+
+	if (reply->overflow)
+		return;
+
+	if (reply->len + nbyte > REPLY_CAPTURE_MAX) {
+		free(reply->capture);
+		reply->capture = NULL;
+		reply->overflow = 1;
+		return;
+	}
+
+	if (reply->len + nbyte > reply->size) {
+		size = reply->size ? reply->size : 1024;
+
+		while (size < reply->len + nbyte)
+			size *= 2;
+
+		if (!(tmp = realloc(reply->capture, size))) {
+			free(reply->capture);
+			reply->capture = NULL;
+			reply->overflow = 1;
+			return;
+		}
+
+		reply->capture = tmp;
+		reply->size = size;
+	}
+
+	memcpy(reply->capture + reply->len, buf, nbyte);
+	reply->len += nbyte;
+}
+
+void reply_log(struct reply *reply, const char *buf, size_t nbyte)
+{
+	size_t limit;
+
+	if (reply->log_size < sizeof(_truncated) || reply->truncated)
+		return;
+
+	/* Keep room for the truncation mark (and the null byte) */
+	limit = reply->log_size - sizeof(_truncated);
+
+	if (reply->log_len + nbyte > limit) {
+		memcpy(reply->log + reply->log_len, buf, limit - reply->log_len);
+		strcpy(reply->log + limit, _truncated);
+
+		reply->log_len = limit + strlen(_truncated);
+		reply->truncated = 1;
+
+		return;
+	}
+
+	memcpy(reply->log + reply->log_len, buf, nbyte);
+	reply->log_len += nbyte;
+	reply->log[reply->log_len] = '\0';
+}
+
+int reply_write(struct reply *reply, const char *buf, size_t nbyte)
+{
+	if (!nbyte)
+		return DA_OK;
+
+	reply_capture(reply, buf, nbyte);
+	reply_log(reply, buf, nbyte);
+
+	return msg_write(reply->client_fd, (char*) buf, nbyte);
+}
+
+int reply_printf(struct reply *reply, const char *format, ...)
+{
+	char buf[1024];
+	va_list args;
+	int n;
+
+	va_start(args, format);
+	n = vsnprintf(buf, sizeof(buf), format, args);
+	va_end(args);
+
+	if (n < 0)
+		return DA_INVALID_PARAMETER;
+
+	return reply_write(reply, buf, MIN((size_t) n, sizeof(buf) - 1));
+}
+
+void reply_destroy(struct reply *reply)
+{
+	free(reply->capture);
+	reply->capture = NULL;
+}
@@ -0,0 +1,437 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "pipes.h"
+#include "server/route.h"
+
+#define ROUTE_BUCKETS 64
+
+struct route {
+	struct route *next;
+	char *country;
+	int *owners;                                /* Ascending worker tags */
+	int n_owners;
+	int pending, from;     /* Migration: <pending> replaces <from>, or -1 */
+	int stale;                                /* Handed it over, or -1 */
+};
+
+struct route_worker {
+	int ready;
+	int down;
+	atomic_int load;                              /* Requests in flight */
+};
+
+static struct route *routes[ROUTE_BUCKETS];
+static int n_routes;
+
+/* Grows under the write lock only, so the read lock covers the counters */
+static struct route_worker *worker_state;
+static int n_workers;
+
+static pthread_rwlock_t route_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Whose turn it is, among the replicas */
+static atomic_uint turn;
+
+static int route_hash(const char *_str, size_t len)
+{
+	unsigned long hash = 5381;
+	const unsigned char *str = (const unsigned char*) _str;
+
+	while (len--)
+		hash = ((hash << 5) + hash) + *str++; /* hash * 33 + c */
+
+	return (int) (hash % ROUTE_BUCKETS);
+}
+
+void route_init(void)
+{
+	int i;
+
+	for (i = 0; i < ROUTE_BUCKETS; ++i)
+		routes[i] = NULL;
+
+	n_routes = 0;
+
+	worker_state = NULL;
+	n_workers = 0;
+
+	atomic_init(&turn, 0);
+}
+
+void route_destroy(void)
+{
+	struct route *route, *next;
+	int i;
+
+	for (i = 0; i < ROUTE_BUCKETS; ++i) {
+		for (route = routes[i]; route; route = next) {
+			next = route->next;
+
+			free(route->country);
+			free(route->owners);
+			free(route);
+		}
+
+		routes[i] = NULL;
+	}
+
+	free(worker_state);
+	worker_state = NULL;
+	n_workers = 0;
+}
+
+/* Call with the write lock held */
+static struct route_worker *get_worker(int tag)
+{
+	struct route_worker *tmp;
+
+	if (tag < 0)
+		return NULL;
+
+	if (tag >= n_workers) {
+		if (!(tmp = realloc(worker_state, (tag + 1) * sizeof(worker_state[0]))))
+			return NULL;
+
+		worker_state = tmp;
+
+		for (; n_workers <= tag; ++n_workers) {
+			worker_state[n_workers].ready = 0;
+			worker_state[n_workers].down = 0;
+			atomic_init(&worker_state[n_workers].load, 0);
+		}
+	}
+
+	return worker_state + tag;
+}
+
+/* Call with the lock held */
+static int healthy(int tag)
+{
+	return tag < n_workers && worker_state[tag].ready && !worker_state[tag].down;
+}
+
+static struct route *find_route(const char *country, size_t len)
+{
+	struct route *route = routes[route_hash(country, len)];
+
+	while (route && (strncmp(route->country, country, len) || route->country[len]))
+		route = route->next;
+
+	return route;
+}
+
+static int is_owner(struct route *route, int tag)
+{
+	int i;
+
+	for (i = 0; i < route->n_owners; ++i) {
+		if (route->owners[i] == tag)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Call with the write lock held */
+static struct route *add_route(const char *country, size_t len)
+{
+	struct route *route;
+	int hash;
+
+	if (!(route = calloc(1, sizeof(*route))) ||
+	    !(route->country = strndup(country, len))) {
+		free(route);
+		return NULL;
+	}
+
+	route->pending = route->from = route->stale = -1;
+
+	hash = route_hash(country, len);
+	route->next = routes[hash];
+	routes[hash] = route;
+
+	n_routes++;
+
+	return route;
+}
+
+/* Keeps them in order: replica i of every country in the same group of
+ * workers (see the master), so that turns go a group at a time */
+static int add_owner(struct route *route, int tag)
+{
+	int *tmp, i;
+
+	if (!(tmp = realloc(route->owners, (route->n_owners + 1) * sizeof(tmp[0]))))
+		return DA_ALLOCATION_ERROR;
+
+	route->owners = tmp;
+
+	for (i = route->n_owners++; i > 0 && tmp[i - 1] > tag; --i)
+		tmp[i] = tmp[i - 1];
+
+	tmp[i] = tag;
+
+	return DA_OK;
+}
+
+static void remove_owner(struct route *route, int tag)
+{
+	int i, j;
+
+	for (i = j = 0; i < route->n_owners; ++i) {
+		if (route->owners[i] != tag)
+			route->owners[j++] = route->owners[i];
+	}
+
+	route->n_owners = j;
+}
+
+void route_begin(int tag)
+{
+	struct route_worker *worker;
+	struct route *route;
+	int i;
+
+	pthread_rwlock_wrlock(&route_lock);
+
+	if ((worker = get_worker(tag)))
+		worker->ready = 0;
+
+	for (i = 0; i < ROUTE_BUCKETS; ++i) {
+		for (route = routes[i]; route; route = route->next) {
+			if (route->pending == tag)
+				route->pending = route->from = -1;
+		}
+	}
+
+	pthread_rwlock_unlock(&route_lock);
+}
+
+void route_hold(int tag, const char *country, size_t len)
+{
+	struct route *route;
+
+	if (tag < 0 || !len)
+		return;
+
+	pthread_rwlock_wrlock(&route_lock);
+
+	if (!(route = find_route(country, len)))
+		route = add_route(country, len);
+
+	/* Loading it on startup: a replica like the rest (not a migration) */
+	if (route && !is_owner(route, tag) && route->pending != tag) {
+		if (route->stale == tag)
+			route->stale = -1;
+
+		add_owner(route, tag);
+	}
+
+	pthread_rwlock_unlock(&route_lock);
+}
+
+void route_move(int tag, const char *country, int from)
+{
+	struct route *route;
+
+	if (tag < 0 || !*country)
+		return;
+
+	pthread_rwlock_wrlock(&route_lock);
+
+	if (!(route = find_route(country, strlen(country))))
+		route = add_route(country, strlen(country));
+
+	/* The holders keep serving it until our READY */
+	if (route && !is_owner(route, tag)) {
+		route->pending = tag;
+		route->from = from;
+
+		if (route->stale == tag)
+			route->stale = -1;          /* Pending is left out, too */
+	}
+
+	pthread_rwlock_unlock(&route_lock);
+}
+
+int route_commit(int tag)
+{
+	struct route_worker *worker;
+	struct route *route;
+	int i, n = 0;
+
+	pthread_rwlock_wrlock(&route_lock);
+
+	if ((worker = get_worker(tag))) {
+		worker->ready = 1;
+		worker->down = 0;
+	}
+
+	for (i = 0; i < ROUTE_BUCKETS; ++i) {
+		for (route = routes[i]; route; route = route->next) {
+			if (route->pending != tag)
+				continue;
+
+			if (route->from >= 0 && is_owner(route, route->from)) {
+				remove_owner(route, route->from);
+				route->stale = route->from;
+			}
+
+			add_owner(route, tag);
+			route->pending = route->from = -1;
+
+			n++;
+		}
+	}
+
+	pthread_rwlock_unlock(&route_lock);
+
+	return n;
+}
+
+void route_down(int tag)
+{
+	struct route_worker *worker;
+
+	pthread_rwlock_wrlock(&route_lock);
+
+	if ((worker = get_worker(tag)))
+		worker->down = 1;
+
+	pthread_rwlock_unlock(&route_lock);
+}
+
+void route_load(int tag, int delta)
+{
+	pthread_rwlock_rdlock(&route_lock);
+
+	if (tag >= 0 && tag < n_workers)
+		atomic_fetch_add(&worker_state[tag].load, delta);
+
+	pthread_rwlock_unlock(&route_lock);
+}
+
+int route_pick(const char *country)
+{
+	struct route *route;
+	int i, w, load, owner = -1, least = 0;
+	unsigned start = atomic_fetch_add(&turn, 1);
+
+	pthread_rwlock_rdlock(&route_lock);
+
+	if ((route = find_route(country, strlen(country))) && route->n_owners) {
+		/* Fewest in flight, taking turns on ties */
+		for (i = 0; i < route->n_owners; ++i) {
+			w = route->owners[(start + i) % route->n_owners];
+
+			if (!healthy(w))
+				continue;
+
+			load = atomic_load(&worker_state[w].load);
+
+			if (owner == -1 || load < least) {
+				owner = w;
+				least = load;
+			}
+		}
+
+		/* None ready: it's still worth a try */
+		if (owner == -1)
+			owner = route->owners[start % route->n_owners];
+	}
+
+	pthread_rwlock_unlock(&route_lock);
+
+	return owner;
+}
+
+/* Call with the lock held. The first ready replica, from the one whose
+ * turn it is; -1 if there's no replica yet */
+static int choose(struct route *route, unsigned start)
+{
+	int i, w;
+
+	if (!route->n_owners)
+		return -1;
+
+	for (i = 0; i < route->n_owners; ++i) {
+		w = route->owners[(start + i) % route->n_owners];
+
+		if (healthy(w))
+			return w;
+	}
+
+	return route->owners[start % route->n_owners];
+}
+
+/* Append <country> to the lines in <buf> (<size> bytes) */
+static int append_line(char *buf, size_t size, const char *country)
+{
+	size_t len = strlen(buf), n = strlen(country);
+
+	if (len + n + 2 > size)
+		return DA_ALLOCATION_ERROR;
+
+	memcpy(buf + len, country, n);
+	buf[len + n] = '\n';
+	buf[len + n + 1] = '\0';
+
+	return DA_OK;
+}
+
+int route_fanout(int workers, int *contact, char *excluded, size_t size, int *n)
+{
+	struct route *route;
+	unsigned start = atomic_fetch_add(&turn, 1);
+	int i, j, w, chosen, holders[2];
+	int ret = DA_OK;
+
+	for (w = 0; w < workers; ++w) {
+		contact[w] = !n_routes;          /* Nothing known yet: everyone */
+		excluded[w * size] = '\0';
+		n[w] = 0;
+	}
+
+	pthread_rwlock_rdlock(&route_lock);
+
+	/* Who answers for every country */
+	for (i = 0; i < ROUTE_BUCKETS; ++i) {
+		for (route = routes[i]; route; route = route->next) {
+			if ((w = choose(route, start)) >= 0 && w < workers)
+				contact[w] = 1;
+		}
+	}
+
+	/* What the others we contact have to leave out */
+	for (i = 0; i < ROUTE_BUCKETS; ++i) {
+		for (route = routes[i]; route; route = route->next) {
+			chosen = choose(route, start);
+
+			/* Every holder: the migrating ones, then the replicas */
+			holders[0] = route->pending;
+			holders[1] = route->stale;
+
+			for (j = -2; j < route->n_owners; ++j) {
+				w = j < 0 ? holders[j + 2] : route->owners[j];
+
+				if (w < 0 || w >= workers || w == chosen || !contact[w])
+					continue;
+
+				if (n[w] == EXCLUDE_MAX ||
+				    append_line(excluded + w * size, size, route->country) != DA_OK)
+					ret = DA_ALLOCATION_ERROR;
+				else
+					n[w]++;
+			}
+		}
+	}
+
+	pthread_rwlock_unlock(&route_lock);
+
+	return ret;
+}
@@ -14,14 +14,27 @@
 #include <poll.h>
 
 #include "common.h"
+#include "histogram.h"
 #include "pipes.h"
+#include "server/cube.h"
+#include "server/flight.h"
+#include "server/log.h"
+#include "server/metrics.h"
 #include "server/r_buf.h"
+#include "server/reply.h"
+#include "server/route.h"
 #include "server/server.h"
+#include "trace.h"
 
 #define STATISTICS 0
 #define QUERY 1
 
+#define QUERY_LOG_SIZE 4096
+#define EXCLUDE_SIZE 4096           /* Countries to leave out, per worker */
+#define LOG_RING_SIZE (256 * 1024)                        /* Per thread */
+
 /* Thread-shared variables */
+static struct server_options *options;
 static int workers;
 /* In network byte order */
 static in_addr_t worker_ip;
@@ -34,23 +47,31 @@ static pthread_cond_t data_available = PTHREAD_COND_INITIALIZER;
 
 static const char _whitespace[] = " \f\n\r\t\v";
 
+/* When the current thread's query was sent to the workers (for their RTT),
+ * and the trace of the query */
+static _Thread_local uint64_t dispatched;
+static _Thread_local struct trace *query_trace;
+
 int listen_at(in_port_t port);
 
 /* Thread Functions */
 void *server_thread(void *args);
 int server_thread_statistics(int worker_fd);
-int server_thread_query(int client_fd);
+int server_thread_query(int client_fd, uint64_t queued);
+void s_slow_query(struct trace *trace, const char *query);
 
-int connect_to_workers(struct pollfd *worker_fd);
+int connect_to_workers(struct pollfd *worker_fd, char *country, int all);
 
 /* Commands */
+int s_cube_query(char *cmd, char *args, struct reply *reply);
 int s_disease_frequency(char *args, struct pollfd *worker_fd);
 int s_topk_age_ranges(char *args, struct pollfd *worker_fd);
 int s_search_patient_record(char *args, struct pollfd *worker_fd);
 int s_num_patients(enum mode mode, char *args, struct pollfd *worker_fd);
+int s_metrics(char *args, struct reply *reply, struct pollfd *worker_fd);
 
-int s_get_response(struct pollfd *worker_fd, struct p_msg *result, int client_fd);
-int s_sum_cases(struct pollfd *worker_fd, struct p_msg *result, int client_fd);
+int s_get_response(struct pollfd *worker_fd, struct reply *reply);
+int s_sum_cases(struct pollfd *worker_fd, struct reply *reply);
 
 /* Signal Stuff */
 static volatile sig_atomic_t server_quit;
@@ -66,7 +87,7 @@ static void s_sig_handler(int sig, siginfo_t *siginfo, void *context)
 	};
 }
 
-int server(in_port_t query_port, in_port_t statistics_port, int n_threads, int buffer_size)
+int server(in_port_t query_port, in_port_t statistics_port, int n_threads, int buffer_size, struct server_options *_options)
 {
 	in_port_t listen_ports[2];
 	struct pollfd sock[2];                          /* Socket Descriptors */
@@ -74,10 +95,13 @@ int server(in_port_t query_port, in_port_t statistics_port, int n_threads, int b
 	struct sockaddr_in incoming;
 	socklen_t len;
 	int fd;                                     /* Returned from accept() */
+	int depth;
 
 	pthread_t threads[n_threads];
 	int i;
 
+	options = _options;
+
 	/* Setup Signal Handlers */
 	sigact.sa_sigaction = s_sig_handler;
 	sigaction(SIGINT, &sigact, NULL);
@@ -102,10 +126,20 @@ int server(in_port_t query_port, in_port_t statistics_port, int n_threads, int b
 
 	fds = make_r_buf(buffer_size);                   /* Setup ring buffer */
 
+	cube_init();
+	route_init();
+	metrics_init();
+
 	/* Assume 1 worker - might be amended later */
 	workers = 1;
 	worker_ports = malloc(workers * sizeof(worker_ports[0]));
 
+	/* Threads log through the writer thread, not stdio */
+	if (log_init(n_threads + 1, LOG_RING_SIZE, options->sampling) != DA_OK) {
+		fputs("server: could not set up logging\n", stderr);
+		return DA_ALLOCATION_ERROR;
+	}
+
 	/* Create threads */
 	for (i = 0; i < n_threads; ++i)
 		pthread_create(threads + i, NULL, server_thread, listen_ports);
@@ -141,15 +175,21 @@ int server(in_port_t query_port, in_port_t statistics_port, int n_threads, int b
 			if (i == STATISTICS)
 				worker_ip = incoming.sin_addr.s_addr;
 
+			metrics_accept(i == STATISTICS ? PORT_STATISTICS : PORT_QUERY);
+
 			pthread_mutex_lock(&mutex);
 
 			while (r_buf_full(fds))
 				pthread_cond_wait(&space_available, &mutex);
 
-			r_buf_push(fds, fd);  /* *Plop* that fd in the buffer */
+			/* *Plop* that fd in the buffer */
+			r_buf_push(fds, fd, histogram_clock());
+			depth = r_buf_count(fds);
 
 			pthread_cond_signal(&data_available);
 			pthread_mutex_unlock(&mutex);
+
+			metrics_queue_push(depth);
 		}
 	}
 
@@ -162,8 +202,13 @@ int server(in_port_t query_port, in_port_t statistics_port, int n_threads, int b
 		pthread_join(threads[i], NULL);
 	}
 
+	log_destroy();
+
 	free(worker_ports);
 
+	metrics_destroy();
+	route_destroy();
+	cube_destroy();
 	r_buf_destroy(fds);
 
 	close(sock[STATISTICS].fd);
@@ -219,8 +264,13 @@ void *server_thread(void *args)
 	socklen_t len;
 	struct sockaddr_in dst;
 
+	uint64_t queued;
+	int depth;
+
 	intptr_t ret = DA_OK;
 
+	log_attach();
+
 	while (!server_quit) {
 		pthread_mutex_lock(&mutex);
 
@@ -233,11 +283,16 @@ void *server_thread(void *args)
 			}
 		}
 
-		fd = r_buf_pop(fds);   /* Snatch that fd from the ring buffer */
+		fd = r_buf_pop(fds, &queued);       /* Snatch that fd from the ring buffer */
+		depth = r_buf_count(fds);
 
 		pthread_cond_signal(&space_available);
 		pthread_mutex_unlock(&mutex);
 
+		queued = histogram_clock() - queued;
+		metrics_queue_pop(depth, queued);
+		metrics_active(1);
+
 		/* Depending on the destination of the request, handle it:
 		 * - Print statistics and save worker port
 		 * - Forward queries/requests to workers */
@@ -250,9 +305,10 @@ void *server_thread(void *args)
 		if (dst.sin_port == listen_ports[STATISTICS])
 			ret = server_thread_statistics(fd);
 		else if (dst.sin_port == listen_ports[QUERY])
-			ret = server_thread_query(fd);
+			ret = server_thread_query(fd, queued);
 
 		close(fd);
+		metrics_active(-1);
 
 		if (ret == DA_SOCK_ERROR) {
 			pthread_mutex_lock(&mutex);
@@ -268,11 +324,13 @@ int server_thread_statistics(int worker_fd)
 {
 	int ready = 0;
 	struct p_msg msg;
-	char *start, *end;
+	char *start, *end, *next;
 
 	int worker_tag;
 	in_port_t worker_port;
 	int got_header = 0;
+	char line[64], *country, *from, *saveptr;
+	int n, moved;
 
 	msg_init(&msg);
 
@@ -305,6 +363,9 @@ int server_thread_statistics(int worker_fd)
 			worker_ports[worker_tag] = htons(worker_port);
 			pthread_mutex_unlock(&mutex);
 
+			cube_worker_begin(worker_tag);
+			route_begin(worker_tag);
+
 			got_header = 1;
 
 			start += strlen(start) + 1;
@@ -315,16 +376,63 @@ int server_thread_statistics(int worker_fd)
 			}
 		}
 
+		/* Migration: the country on its way (and the worker it comes
+		 * from), before its statistics. The worker waits for our READY to
+		 * know that queries leave it out from then on */
+		if (!strncmp(start, CMD_LOAD MSG_DELIMITER, strlen(CMD_LOAD) + 1)) {
+			next = start + strlen(start) + 1;
+
+			if ((country = strtok_r(start + strlen(CMD_LOAD) + 1, MSG_DELIMITER, &saveptr))) {
+				from = strtok_r(NULL, MSG_DELIMITER, &saveptr);
+				route_move(worker_tag, country, from ? atoi(from) : -1);
+			}
+
+			msg_ready(worker_fd);
+			start = next;
+
+			if (start > end) {
+				msg.consumed = 1;
+				continue;
+			}
+		}
+
 		if (!strcmp(end - strlen(MSG_READY), MSG_READY)) {
 			ready++;
 			end -= strlen(MSG_READY) + 1;
-
-			close(worker_fd);
 		}
 
-		/* Print statistics (fwrite guarantees thread safety) */
+		/* Print statistics */
 		if (start < end)
-			fwrite(start, end - start, 1, stdout);
+			log_write(start, end - start);
+
+		/* Then fill the cube, one file (message) at a time */
+		while (start < end) {
+			next = start + strlen(start) + 1;
+
+			/* File, then country */
+			if ((country = strchr(start, '\n')))
+				route_hold(worker_tag, country + 1, strcspn(country + 1, MSG_DELIMITER));
+
+			cube_add_statistics(worker_tag, start);
+			start = next;
+		}
+
+		if (ready) {
+			cube_worker_ready(worker_tag);
+			metrics_worker_ready(worker_tag);
+
+			n = snprintf(line, sizeof(line), "[ready] worker %d, port %hu\n",
+			             worker_tag, worker_port);
+			log_write(line, n);
+
+			/* Migrated countries: the worker waits for us to close
+			 * (see server_thread) before it takes over */
+			if ((moved = route_commit(worker_tag))) {
+				n = snprintf(line, sizeof(line), "[route] worker %d: %d countries moved in\n",
+				             worker_tag, moved);
+				log_write(line, n);
+			}
+		}
 
 		msg.consumed = 1;
 	}
@@ -332,16 +440,34 @@ int server_thread_statistics(int worker_fd)
 	return DA_OK;
 }
 
-int server_thread_query(int client_fd)
+/* <queued>: time (us) the client waited in the ring buffer */
+int server_thread_query(int client_fd, uint64_t queued)
 {
 	struct p_msg client_msg;
 	char *cmd, *args = NULL;
 
 	struct pollfd worker_fd[workers];
-	struct p_msg result;
+	struct reply reply;
+	char log[QUERY_LOG_SIZE];         /* Bounded copy of query and response */
+	char header[256];
+	size_t n;
+
+	/* Coalescing of identical queries */
+	char key[sizeof(client_msg.buffer)];
+	struct flight *flight;
+	const char *flight_response = NULL;
+	size_t len;
+	int leader, logged;
+
+	int ret = DA_INVALID_CMD, cube = DA_INVALID_CMD;
+	char *cmd_err = "Error in request.\n";
+
+	uint64_t start;
+	char label[32];                               /* Command, for metrics */
 
-	int ret = DA_INVALID_CMD;
-	char *cmd_err = "Error in request.";
+	struct trace trace;
+	char trace_id[TRACE_ID_SIZE], *query;
+	uint64_t t, now = trace_clock();
 
 	/* Read cmd from client */
 	msg_init(&client_msg);
@@ -352,13 +478,65 @@ int server_thread_query(int client_fd)
 		return DA_SOCK_ERROR;
 	}
 
-	msg_init(&result);
+	start = histogram_clock();
 
-	/* Broadcast cmd (if valid) to workers and forward results to client */
-	if ((cmd = strtok_r(client_msg.buffer, _whitespace, &args))) {
-		result.pos += sprintf(result.buffer, "[%lu]: %s %s\n", pthread_self(), cmd, args);
+	/* Traced query? Header is not part of the query (e.g. for coalescing) */
+	query = trace_header(client_msg.buffer, trace_id);
 
-		if (!strcmp(cmd, CMD_DISEASE_FREQUENCY))
+	trace_init(&trace, trace_id);
+	trace_span(&trace, "queue", -1, now - queued, now);
+	trace_span(&trace, "read", -1, now, trace_clock());
+	query_trace = &trace;
+
+	/* Same query already in progress? Wait for it and use its response */
+	flight_key(key, sizeof(key), query);
+
+	if (sscanf(key, "%31s", label) != 1)
+		label[0] = '\0';
+	flight = flight_join(key, &leader);
+
+	/* Log (some of) the queries */
+	logged = options->verbosity && log_sample();
+
+	reply_init(&reply, client_fd, leader && flight, log, logged ? sizeof(log) - 1 : 0);
+
+	if (!leader) {
+		t = trace_clock();
+		ret = flight_wait(flight, &flight_response, &len);
+		trace_span(&trace, "coalesced", -1, t, trace_clock());
+
+		if (flight_response) {
+			n = snprintf(header, sizeof(header), "[%lu]: %.128s (coalesced)\n",
+			             pthread_self(), key);
+			reply_log(&reply, header, MIN(n, sizeof(header) - 1));
+
+			if (options->verbosity < 2)
+				reply.log_size = 0;           /* Just the query */
+
+			reply_write(&reply, flight_response, len);
+		}
+
+		/* If not, the response was too big to share: run it ourselves */
+		flight_leave(flight);
+		flight = NULL;
+	}
+
+	/* Answer from the cube if possible. Otherwise, broadcast cmd (if valid)
+	 * to workers and forward results to client */
+	if (!flight_response && (cmd = strtok_r(query, _whitespace, &args))) {
+		n = snprintf(header, sizeof(header), "[%lu]: %s %s\n", pthread_self(), cmd, args);
+		reply_log(&reply, header, MIN(n, sizeof(header) - 1));
+
+		if (options->verbosity < 2)
+			reply.log_size = 0;                   /* Just the query */
+
+		t = trace_clock();
+
+		if ((cube = s_cube_query(cmd, args, &reply)) == DA_OK) {
+			trace_span(&trace, "cube", -1, t, trace_clock());
+			ret = DA_OK;
+		}
+		else if (!strcmp(cmd, CMD_DISEASE_FREQUENCY))
 			ret = s_disease_frequency(args, worker_fd);
 		else if (!strcmp(cmd, CMD_TOPK_AGE_RANGES))
 			ret = s_topk_age_ranges(args, worker_fd);
@@ -368,43 +546,272 @@ int server_thread_query(int client_fd)
 			ret = s_num_patients(ENTER, args, worker_fd);
 		else if (!strcmp(cmd, CMD_NUM_DISCHARGES))
 			ret = s_num_patients(EXIT, args, worker_fd);
+		else if (!strcmp(cmd, CMD_METRICS))
+			ret = s_metrics(args, &reply, worker_fd);
 	}
 
-	if (ret == DA_OK) {
+	if (flight_response || cube == DA_OK) {
+		/* Already answered */
+	} else if (ret == DA_OK) {
 		if (!strcmp(cmd, CMD_DISEASE_FREQUENCY))
-			ret = s_sum_cases(worker_fd, &result, client_fd);
+			ret = s_sum_cases(worker_fd, &reply);
 		else
-			ret = s_get_response(worker_fd, &result, client_fd);
+			ret = s_get_response(worker_fd, &reply);
 	} else {
-		result.pos += sprintf(result.pos, "%s\n", cmd_err);
-		msg_write_line(client_fd, cmd_err);
+		reply_write(&reply, cmd_err, strlen(cmd_err));
+	}
+
+	/* Hand the response over to the coalesced queries */
+	if (flight) {
+		if (reply.overflow)
+			flight_land(flight, NULL, 0, ret);
+		else
+			flight_land(flight, reply.capture ? reply.capture : "", reply.len, ret);
+
+		flight_leave(flight);
 	}
 
-	puts(result.buffer);
+	metrics_query(label, flight_response ? SOURCE_COALESCED :
+	              cube == DA_OK ? SOURCE_CUBE : SOURCE_WORKERS,
+	              ret, histogram_clock() - start);
+
+	trace_span(&trace, "query", -1, now, trace_clock());
+	trace_write(&trace, "server", key);
+
+	if (options->slow_ms > 0 && histogram_clock() - start >= options->slow_ms * 1000UL)
+		s_slow_query(&trace, key);
+
+	query_trace = NULL;
+
+	if (logged) {
+		log[reply.log_len] = '\n';              /* There's room for it */
+		log_write(log, reply.log_len + 1);
+	}
+
+	reply_destroy(&reply);
 	msg_done(client_fd);
 
 	return ret;
 }
 
-int connect_to_workers(struct pollfd *worker_fd)
+/* Slow query log: where the time went */
+void s_slow_query(struct trace *trace, const char *query)
+{
+	char buf[1024], spans[768];
+	int n;
+
+	trace_format(trace, spans, sizeof(spans));
+
+	n = snprintf(buf, sizeof(buf), "[slow] %.128s%s%s: %s\n", query,
+	             trace->id[0] ? " " TRACE_HEADER " " : "", trace->id, spans);
+
+	log_write(buf, MIN((size_t) n, sizeof(buf) - 1));
+}
+
+/* Close the connections opened so far */
+static void disconnect_workers(struct pollfd *worker_fd, int n)
 {
 	int w;
+
+	for (w = 0; w < n; ++w) {
+		if (worker_fd[w].fd != -1)
+			close(worker_fd[w].fd);
+
+		worker_fd[w].fd = -1;
+	}
+}
+
+/* <all>: every worker (e.g. for its metrics). Otherwise one replica per
+ * country: the least loaded for a query about a single <country>, or for
+ * all of them, those whose turn it is (see route.h). Replicas that can't be
+ * reached are marked down, and others are tried instead.
+ * Workers not contacted have fd -1 */
+int connect_to_workers(struct pollfd *worker_fd, char *country, int all)
+{
+	int w, owner, tries;
 	struct sockaddr_in to_worker;
+	uint64_t t = trace_clock();
+	char str[16];
+
+	int contact[workers], n_excluded[workers];
+	char *excluded = NULL;
+
+	int ret = DA_OK;
 
 	/* Open connection to worker, to forward query */
 	to_worker.sin_family = AF_INET;
 	to_worker.sin_addr.s_addr = worker_ip;
 
+	for (tries = 0; tries <= workers; ++tries) {
+		ret = DA_OK;
+
+		for (w = 0; w < workers; ++w) {
+			contact[w] = all;
+			n_excluded[w] = 0;
+			worker_fd[w].fd = -1;                 /* poll() ignores it */
+			worker_fd[w].events = POLLIN;
+		}
+
+		if (!all && country && (owner = route_pick(country)) >= 0 && owner < workers) {
+			contact[owner] = 1;
+		} else if (!all) {
+			/* Unknown countries too: workers answer as before */
+			if (!excluded && !(excluded = malloc(workers * EXCLUDE_SIZE)))
+				return DA_ALLOCATION_ERROR;
+
+			if (route_fanout(workers, contact, excluded, EXCLUDE_SIZE, n_excluded) != DA_OK) {
+				fputs("server: too many countries to leave out\n", stderr);
+				free(excluded);
+				return DA_INVALID_PARAMETER;
+			}
+		}
+
+		for (w = 0; ret == DA_OK && w < workers; ++w) {
+			if (!contact[w])
+				continue;
+
+			worker_fd[w].fd = socket(AF_INET, SOCK_STREAM, 0);
+
+			to_worker.sin_port = worker_ports[w];
+			//printf("Worker %d: Port %hu\n", w, worker_ports[w]);
+
+			if (connect(worker_fd[w].fd, (struct sockaddr*) &to_worker, sizeof(to_worker)) == -1) {
+				perror("server: connect() to worker");
+				metrics_worker_error(w);
+				route_down(w);
+
+				ret = DA_SOCK_ERROR;
+			}
+		}
+
+		if (ret == DA_OK || all)
+			break;
+
+		/* Again, with the replicas that are left */
+		disconnect_workers(worker_fd, workers);
+	}
+
+	if (ret != DA_OK) {
+		disconnect_workers(worker_fd, workers);
+		free(excluded);
+		return ret;
+	}
+
+	dispatched = histogram_clock();
+
 	for (w = 0; w < workers; ++w) {
-		worker_fd[w].fd = socket(AF_INET, SOCK_STREAM, 0);
-		worker_fd[w].events = POLLIN;
+		if (worker_fd[w].fd != -1)
+			route_load(w, 1);
+	}
 
-		to_worker.sin_port = worker_ports[w];
-		//printf("Worker %d: Port %hu\n", w, worker_ports[w]);
+	if (query_trace) {
+		trace_span(query_trace, "connect", -1, t, trace_clock());
 
-		if (connect(worker_fd[w].fd, (struct sockaddr*) &to_worker, sizeof(to_worker)) == -1) {
-			perror("server: connect() to worker");
-			return DA_SOCK_ERROR;
+		/* Workers trace their part too */
+		for (w = 0; query_trace->id[0] && w < workers; ++w) {
+			if (worker_fd[w].fd == -1)
+				continue;
+
+			msg_write_line(worker_fd[w].fd, TRACE_HEADER);
+			msg_write_line(worker_fd[w].fd, query_trace->id);
+		}
+	}
+
+	/* Countries another worker answers for (replicas, migrations) */
+	for (w = 0; excluded && w < workers; ++w) {
+		if (worker_fd[w].fd == -1 || !n_excluded[w])
+			continue;
+
+		snprintf(str, sizeof(str), "%d", n_excluded[w]);
+
+		msg_write_line(worker_fd[w].fd, MSG_EXCLUDE);
+		msg_write_line(worker_fd[w].fd, str);
+		msg_write(worker_fd[w].fd, excluded + w * EXCLUDE_SIZE,
+		          strlen(excluded + w * EXCLUDE_SIZE));
+	}
+
+	free(excluded);
+
+	return DA_OK;
+}
+
+/* Admissions (by disease, age group and country) are in the cube.
+ * Returns DA_OK if the query was answered from it */
+int s_cube_query(char *cmd, char *args, struct reply *reply)
+{
+	char buf[512], *saveptr = NULL;
+	char *str_k = NULL, *disease, *date1, *date2, *country = NULL;
+	int day1, day2, k, topk;
+
+	long count, age_group[4];
+	char *str_age_group[4] = {"0-20", "21-40", "41-60", "60+"};
+	int i, max;
+
+	if (strcmp(cmd, CMD_DISEASE_FREQUENCY) && strcmp(cmd, CMD_NUM_ADMISSIONS) &&
+	    strcmp(cmd, CMD_TOPK_AGE_RANGES))
+		return DA_INVALID_CMD;
+
+	topk = !strcmp(cmd, CMD_TOPK_AGE_RANGES);
+
+	/* Leave args intact, for the workers */
+	if (strlen(args) >= sizeof(buf))
+		return DA_INVALID_PARAMETER;
+
+	strcpy(buf, args);
+
+	if (topk) {
+		if (!(str_k = strtok_r(buf, _whitespace, &saveptr)) ||
+		    strspn(str_k, "0123456789") != strlen(str_k) ||
+		    !(country = strtok_r(NULL, _whitespace, &saveptr)))
+			return DA_INVALID_PARAMETER;
+
+		disease = strtok_r(NULL, _whitespace, &saveptr);
+	} else {
+		disease = strtok_r(buf, _whitespace, &saveptr);
+	}
+
+	if (!disease ||
+	    !(date1 = strtok_r(NULL, _whitespace, &saveptr)) ||
+	    !(date2 = strtok_r(NULL, _whitespace, &saveptr)))
+		return DA_INVALID_PARAMETER;
+
+	if (!topk)
+		country = strtok_r(NULL, _whitespace, &saveptr);
+
+	if (strtok_r(NULL, _whitespace, &saveptr))    /* Extra arguments: BAD */
+		return DA_INVALID_PARAMETER;
+
+	/* Per-country admissions need a country */
+	if (!strcmp(cmd, CMD_NUM_ADMISSIONS) && !country)
+		return DA_INVALID_PARAMETER;
+
+	/* Invalid dates are left to the workers (and their error reporting) */
+	if ((day1 = cube_day(date1)) < 0 || (day2 = cube_day(date2)) < 0 || day1 > day2)
+		return DA_INVALID_DATE;
+
+	if (cube_admissions(disease, country, day1, day2, &count, age_group) != DA_OK)
+		return DA_INVALID_PARAMETER;
+
+	/* Same output as the workers */
+	if (!strcmp(cmd, CMD_DISEASE_FREQUENCY)) {
+		reply_printf(reply, "%ld\n", count);
+	} else if (!topk) {
+		reply_printf(reply, "%s %ld\n", country, count);
+	} else if (count) {
+		k = MIN(atoi(str_k), 4);
+
+		while (k--) {
+			max = 0;
+			for (i = 1; i < 4; ++i) {
+				if (age_group[i] > age_group[max])
+					max = i;
+			}
+
+			reply_printf(reply, "%s: %.2f%%\n",
+			             str_age_group[max],
+			             100.0 * ((double) age_group[max]) / ((double) count));
+
+			age_group[max] = -1;
 		}
 	}
 
@@ -432,10 +839,15 @@ int s_disease_frequency(char *args, struct pollfd *worker_fd)
 			return DA_INVALID_PARAMETER;  /* Extra arguments: BAD */
 	}
 
-	if (connect_to_workers(worker_fd) != DA_OK)
+	if (connect_to_workers(worker_fd, country, 0) != DA_OK)
 		return DA_SOCK_ERROR;
 
+	/* Workers only need to send back their partial sum */
 	for (w = 0; w < workers; ++w) {
+		if (worker_fd[w].fd == -1)
+			continue;
+
+		msg_write_line(worker_fd[w].fd, CMD_AGGREGATE);
 		msg_write_line(worker_fd[w].fd, CMD_NUM_ADMISSIONS);
 		msg_write_line(worker_fd[w].fd, disease);
 		msg_write_line(worker_fd[w].fd, date1);
@@ -478,10 +890,13 @@ int s_topk_age_ranges(char *args, struct pollfd *worker_fd)
 	if (strtok_r(NULL, _whitespace, &saveptr))    /* Extra arguments: BAD */
 		return DA_INVALID_PARAMETER;
 
-	if (connect_to_workers(worker_fd) != DA_OK)
+	if (connect_to_workers(worker_fd, country, 0) != DA_OK)
 		return DA_SOCK_ERROR;
 
 	for (w = 0; w < workers; ++w) {
+		if (worker_fd[w].fd == -1)
+			continue;
+
 		msg_write_line(worker_fd[w].fd, CMD_TOPK_AGE_RANGES);
 		msg_write_line(worker_fd[w].fd, k);
 		msg_write_line(worker_fd[w].fd, country);
@@ -508,10 +923,13 @@ int s_search_patient_record(char *args, struct pollfd *worker_fd)
 	if (strtok_r(NULL, _whitespace, &saveptr))  /* Extra arguments: BAD */
 		return DA_INVALID_PARAMETER;
 
-	if (connect_to_workers(worker_fd) != DA_OK)
+	if (connect_to_workers(worker_fd, NULL, 0) != DA_OK)
 		return DA_SOCK_ERROR;
 
 	for (w = 0; w < workers; ++w) {
+		if (worker_fd[w].fd == -1)
+			continue;
+
 		msg_write_line(worker_fd[w].fd, CMD_SEARCH_RECORD);
 		msg_write_line(worker_fd[w].fd, record_id);
 
@@ -543,10 +961,13 @@ int s_num_patients(enum mode mode, char *args, struct pollfd *worker_fd)
 			return DA_INVALID_PARAMETER;  /* Extra arguments: BAD */
 	}
 
-	if (connect_to_workers(worker_fd) != DA_OK)
+	if (connect_to_workers(worker_fd, country, 0) != DA_OK)
 		return DA_SOCK_ERROR;
 
 	for (w = 0; w < workers; ++w) {
+		if (worker_fd[w].fd == -1)
+			continue;
+
 		if (mode == ENTER)
 			msg_write_line(worker_fd[w].fd, CMD_NUM_ADMISSIONS);
 		else
@@ -565,150 +986,288 @@ int s_num_patients(enum mode mode, char *args, struct pollfd *worker_fd)
 	return DA_OK;
 }
 
-int s_get_response(struct pollfd *worker_fd, struct p_msg *result, int client_fd)
+/* Server metrics, followed by the workers' */
+int s_metrics(char *args, struct reply *reply, struct pollfd *worker_fd)
+{
+	char *saveptr = NULL;
+	int w;
+
+	if (strtok_r(args, _whitespace, &saveptr))   /* No arguments expected */
+		return DA_INVALID_PARAMETER;
+
+	metrics_report(reply);
+
+	if (connect_to_workers(worker_fd, NULL, 1) != DA_OK)
+		return DA_SOCK_ERROR;
+
+	for (w = 0; w < workers; ++w) {
+		if (worker_fd[w].fd == -1)
+			continue;
+
+		msg_write_line(worker_fd[w].fd, CMD_METRICS);
+		msg_done(worker_fd[w].fd);
+	}
+
+	return DA_OK;
+}
+
+/* Worker <w> answered: RTT in metrics and trace */
+static void s_worker_done(int w)
+{
+	uint64_t rtt = histogram_clock() - dispatched, now;
+
+	metrics_worker_rtt(w, rtt);
+	route_load(w, -1);
+
+	if (query_trace) {
+		now = trace_clock();
+		trace_span(query_trace, "worker", w, now - rtt, now);
+	}
+}
+
+/* Workers that didn't answer in time */
+static void s_timeout(struct pollfd *worker_fd)
+{
+	int w;
+
+	for (w = 0; w < workers; ++w) {
+		if (worker_fd[w].fd == -1)
+			continue;
+
+		metrics_worker_timeout(w);
+		route_load(w, -1);
+
+		close(worker_fd[w].fd);
+		worker_fd[w].fd = -1;
+	}
+}
+
+/* Worker response, relayed to the client as it arrives */
+struct relay {
+	char buffer[sizeof(((struct p_msg*) 0)->buffer)];
+	size_t len;
+	int payload;                     /* In the middle of a data message */
+	int ready;
+	int invalid;
+};
+
+/* Is <str> (<len> bytes, no null byte) the start of control message <msg>? */
+static int relay_control(const char *str, size_t len, const char *msg)
+{
+	return len <= strlen(msg) && !memcmp(str, msg, len);
+}
+
+/* Hand complete data lines over to the client. Null bytes (message
+ * boundaries) and control messages (READY, INVALID) are dropped. */
+void relay_flush(struct relay *relay, struct reply *reply, int eof)
+{
+	char *pos = relay->buffer, *end = relay->buffer + relay->len;
+	char *null, *newline;
+	size_t len;
+
+	while (pos < end && !relay->ready) {
+		null = memchr(pos, '\0', end - pos);
+
+		if (!relay->payload) {
+			/* Start of message: might be a control message */
+			len = null ? (size_t) (null - pos) : (size_t) (end - pos);
+
+			if (relay_control(pos, len, MSG_READY) ||
+			    relay_control(pos, len, MSG_INVALID)) {
+				if (!null && !eof)
+					break;        /* Wait for the rest of it */
+
+				if (null && !strcmp(pos, MSG_READY)) {
+					relay->ready = 1;
+					pos = null + 1;
+					break;
+				}
+
+				if (null && !strcmp(pos, MSG_INVALID)) {
+					relay->invalid = 1;
+					pos = null + 1;
+					continue;
+				}
+			}
+
+			relay->payload = 1;
+		}
+
+		if (null) {
+			reply_write(reply, pos, null - pos);
+
+			relay->payload = 0;
+			pos = null + 1;
+		} else if ((newline = memrchr(pos, '\n', end - pos))) {
+			/* Whole lines only, not to mix them up with other workers */
+			reply_write(reply, pos, newline + 1 - pos);
+			pos = newline + 1;
+		} else {
+			/* Buffer full of a single line, or no more data coming */
+			if (eof || (pos == relay->buffer && relay->len == sizeof(relay->buffer))) {
+				reply_write(reply, pos, end - pos);
+				pos = end;
+			}
+
+			break;
+		}
+	}
+
+	/* Keep the unfinished part for later */
+	relay->len = end - pos;
+	memmove(relay->buffer, pos, relay->len);
+}
+
+int s_get_response(struct pollfd *worker_fd, struct reply *reply)
 {
-	struct p_msg worker_msg[workers];
-	char *start, *end;
-	int w, ready = 0, invalid = 0;
+	struct relay relay[workers];
+	char err[128];
+	ssize_t n_read;
+	int w, ready = 0, expected = 0;
 	int flags;
 
 	int ret = DA_OK;
 
 	for (w = 0; w < workers; ++w) {
+		if (worker_fd[w].fd == -1)
+			continue;                     /* Not asked */
+
+		expected++;
+
 		/* Set non-blocking mode for socket */
 		flags = fcntl(worker_fd[w].fd, F_GETFL, 0);
 		fcntl(worker_fd[w].fd, F_SETFL, flags | O_NONBLOCK);
 
-		msg_init(worker_msg + w);
+		relay[w].len = 0;
+		relay[w].payload = 0;
+		relay[w].ready = 0;
+		relay[w].invalid = 0;
 	}
 
-	while (ready < workers) {
-		if (poll(worker_fd, workers, TIMEOUT) < 0) {
+	while (ready < expected) {
+		if (poll(worker_fd, workers, TIMEOUT) <= 0) {
+			s_timeout(worker_fd);
 			ret = DA_INVALID_PARAMETER;
 			break;
 		}
 
 		for (w = 0; w < workers; ++w) {
-			if (!(worker_fd[w].revents & POLLIN))
+			if (!(worker_fd[w].revents & (POLLIN | POLLHUP)))
 				continue;
 
-			if (msg_read(worker_fd[w].fd, worker_msg + w) == DA_SOCK_ERROR) {
-				start = strerror_r(errno, worker_msg[0].buffer, sizeof(worker_msg[0].buffer));
-				fprintf(stderr, "read() response from worker: %s\n", start);
-				return DA_SOCK_ERROR;
-			}
+			n_read = read(worker_fd[w].fd, relay[w].buffer + relay[w].len,
+			              sizeof(relay[w].buffer) - relay[w].len);
 
-			start = worker_msg[w].buffer;
+			if (n_read == -1) {
+				if (errno == EAGAIN || errno == EINTR)
+					continue;
 
-			/* Find last position of '\0' in read data.
-			   Then we can can handle the string (message) */
-			end = memrchr(start, '\0', worker_msg[w].pos - start);
+				fprintf(stderr, "read() response from worker: %s\n",
+				        strerror_r(errno, err, sizeof(err)));
+				return DA_SOCK_ERROR;
+			}
 
-			if (!end)
-				continue;         /* No complete messages yet */
+			relay[w].len += n_read;
+			relay_flush(relay + w, reply, !n_read);
 
-			if (!strcmp(end - strlen(MSG_READY), MSG_READY)) {
-				ready++;
-				end -= strlen(MSG_READY) + 1;
+			/* Done: READY, or the worker closed the connection */
+			if (!relay[w].ready && n_read)
+				continue;
 
-				worker_fd[w].events = 0;
-				close(worker_fd[w].fd);
-			}
+			ready++;
+			s_worker_done(w);
 
-			/* Send (valid) worker result to client */
-			if (start < end) {
-				if (!strcmp(end - strlen(MSG_INVALID), MSG_INVALID)) {
-					invalid++;
-					ret = DA_INVALID_PARAMETER;
-				} else {
-					result->pos += sprintf(result->pos, "%s", start);
-					msg_write(client_fd, start, strlen(start));
-				}
-			}
+			close(worker_fd[w].fd);
+			worker_fd[w].fd = -1;                 /* poll() ignores it */
 
-			worker_msg[w].consumed = 1;
+			if (relay[w].invalid || !relay[w].ready)
+				ret = DA_INVALID_PARAMETER;
 		}
 	}
 
 	return ret;
 }
 
-int s_sum_cases(struct pollfd *worker_fd, struct p_msg *result, int client_fd)
+int s_sum_cases(struct pollfd *worker_fd, struct reply *reply)
 {
 	int flags;
-	struct p_msg worker_msg[workers];
-	char *start, *end, *saveptr = NULL;
-	int w, ready = 0, invalid = 0;
+	char err[128];
+
+	/* Worker response: struct p_aggregate, then MSG_READY */
+	char response[workers][sizeof(struct p_aggregate) + sizeof(MSG_READY)];
+	struct p_aggregate agg;
+	size_t got[workers];
+	ssize_t n_read;
+	int w, ready = 0, expected = 0;
 
-	int n, cases = 0;
+	long cases = 0;
 	int ret = DA_OK;
 
 	for (w = 0; w < workers; ++w) {
+		if (worker_fd[w].fd == -1)
+			continue;                     /* Not asked */
+
+		expected++;
+
 		/* Set non-blocking mode for socket */
 		flags = fcntl(worker_fd[w].fd, F_GETFL, 0);
 		fcntl(worker_fd[w].fd, F_SETFL, flags | O_NONBLOCK);
 
-		msg_init(worker_msg + w);
+		got[w] = 0;
 	}
 
-	while (ready < workers) {
-		if (poll(worker_fd, workers, TIMEOUT) < 0) {
+	while (ready < expected) {
+		if (poll(worker_fd, workers, TIMEOUT) <= 0) {
+			s_timeout(worker_fd);
 			ret = DA_INVALID_PARAMETER;
 			break;
 		}
 
 		for (w = 0; w < workers; ++w) {
-			if (!(worker_fd[w].revents & POLLIN))
+			if (!(worker_fd[w].revents & (POLLIN | POLLHUP)))
 				continue;
 
-			if (msg_read(worker_fd[w].fd, worker_msg + w) == DA_SOCK_ERROR) {
-				start = strerror_r(errno, worker_msg[0].buffer, sizeof(worker_msg[0].buffer));
-				fprintf(stderr, "read() response from worker: %s\n", start);
+			n_read = read(worker_fd[w].fd, response[w] + got[w],
+			              sizeof(response[w]) - got[w]);
+
+			if (n_read == -1) {
+				if (errno == EAGAIN || errno == EINTR)
+					continue;
+
+				fprintf(stderr, "read() response from worker: %s\n",
+				        strerror_r(errno, err, sizeof(err)));
 				return DA_SOCK_ERROR;
 			}
 
-			start = worker_msg[w].buffer;
+			got[w] += n_read;
 
-			/* Find last position of '\0' in read data.
-			   Then we can can handle the string (message) */
-			end = memrchr(start, '\0', worker_msg[w].pos - start);
+			/* Whole response or EOF: worker is done */
+			if (n_read && got[w] < sizeof(response[w]))
+				continue;
 
-			if (!end)
-				continue;         /* No complete messages yet */
+			ready++;
+			s_worker_done(w);
 
-			if (!strcmp(end - strlen(MSG_READY), MSG_READY)) {
-				ready++;
-				end -= strlen(MSG_READY) + 1;
+			close(worker_fd[w].fd);
+			worker_fd[w].fd = -1;                 /* poll() ignores it */
 
-				worker_fd[w].events = 0;
-				close(worker_fd[w].fd);
+			if (got[w] < sizeof(response[w]) ||
+			    memcmp(response[w] + sizeof(agg), MSG_READY, sizeof(MSG_READY))) {
+				ret = DA_INVALID_PARAMETER;     /* Not an aggregate */
+				continue;
 			}
 
-			/* Send (valid) worker result to client */
-			if (start < end) {
-				if (!strcmp(end - strlen(MSG_INVALID), MSG_INVALID)) {
-					invalid++;
-					ret = DA_INVALID_PARAMETER;
-				} else {
-					start = strtok_r(start, MSG_DELIMITER, &saveptr);
-					while (start) {
-						sscanf(start, "%*s %d", &n);
-						cases += n;
-
-						start = strtok_r(NULL, MSG_DELIMITER, &saveptr);
-					}
-				}
-			}
+			memcpy(&agg, response[w], sizeof(agg));
+			msg_decode_aggregate(&agg);
 
-			worker_msg[w].consumed = 1;
+			/* Invalid country/dates just don't contribute, as before */
+			if (agg.status == DA_OK)
+				cases += agg.count;
 		}
 	}
 
 	/* Send back result to client */
-	n = sprintf(result->pos, "%d\n", cases);
-	msg_write(client_fd, result->pos, n);
-
-	result->pos += n;
+	reply_printf(reply, "%ld\n", cases);
 
 	return ret;
 }
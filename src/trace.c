@@ -0,0 +1,167 @@
+#include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "trace.h"
+
+static int trace_fd = -1;
+static pid_t trace_pid;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t trace_clock(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void trace_init(struct trace *trace, const char *id)
+{
+	snprintf(trace->id, sizeof(trace->id), "%s", id ? id : "");
+	trace->spans = 0;
+}
+
+void trace_span(struct trace *trace, const char *name, int index, uint64_t start, uint64_t end)
+{
+	struct trace_span *span;
+
+	if (trace->spans >= TRACE_SPANS)
+		return;
+
+	span = trace->span + trace->spans++;
+
+	span->name = name;
+	span->index = index;
+	span->start = start;
+	span->end = end < start ? start : end;
+}
+
+char *trace_header(char *query, char *id)
+{
+	char *pos = query;
+	size_t len;
+
+	id[0] = '\0';
+
+	while (isspace((unsigned char) *pos))
+		pos++;
+
+	if (strncmp(pos, TRACE_HEADER, strlen(TRACE_HEADER)) ||
+	    !isspace((unsigned char) pos[strlen(TRACE_HEADER)]))
+		return query;
+
+	pos += strlen(TRACE_HEADER);
+
+	while (isspace((unsigned char) *pos))
+		pos++;
+
+	/* Ids are alphanumeric (and '-'), anything else ends them */
+	for (len = 0; isalnum((unsigned char) pos[len]) || pos[len] == '-'; ++len)
+		continue;
+
+	memcpy(id, pos, MIN(len, TRACE_ID_SIZE - 1));
+	id[MIN(len, TRACE_ID_SIZE - 1)] = '\0';
+
+	pos += len;
+
+	while (isspace((unsigned char) *pos))
+		pos++;
+
+	return pos;
+}
+
+/* traces/<process>.<pid>, opened once per process (and again after fork()) */
+static int trace_open(const char *process)
+{
+	char path[64];
+
+	pthread_mutex_lock(&mutex);
+
+	if (trace_fd == -1 || trace_pid != getpid()) {
+		if (trace_fd != -1)
+			close(trace_fd);
+
+		trace_pid = getpid();
+
+		mkdir(TRACE_DIR, 0755);
+		snprintf(path, sizeof(path), TRACE_DIR "/%.32s.%d", process, trace_pid);
+
+		trace_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	}
+
+	pthread_mutex_unlock(&mutex);
+
+	return trace_fd;
+}
+
+int trace_write(const struct trace *trace, const char *process, const char *detail)
+{
+	char buf[TRACE_SPANS * 160], name[48];
+	size_t len = 0;
+	int fd, i, n;
+
+	if (!trace->id[0] || !trace->spans)
+		return DA_OK;
+
+	if ((fd = trace_open(process)) == -1)
+		return DA_FILE_ERROR;
+
+	for (i = 0; i < trace->spans && len < sizeof(buf); ++i) {
+		if (trace->span[i].index < 0)
+			snprintf(name, sizeof(name), "%s", trace->span[i].name);
+		else
+			snprintf(name, sizeof(name), "%s.%d", trace->span[i].name, trace->span[i].index);
+
+		n = snprintf(buf + len, sizeof(buf) - len, "%s %s %d %s %lu %lu %.64s\n",
+		             trace->id, process, (int) getpid(), name,
+		             (unsigned long) trace->span[i].start,
+		             (unsigned long) trace->span[i].end,
+		             detail ? detail : "");
+
+		if (n < 0)
+			break;
+
+		len = MIN(len + n, sizeof(buf));
+	}
+
+	/* Lines of a trace stay together: O_APPEND and a single write() */
+	if (write(fd, buf, len) == -1)
+		return DA_FILE_ERROR;
+
+	return DA_OK;
+}
+
+int trace_format(const struct trace *trace, char *buf, size_t size)
+{
+	size_t len = 0;
+	int i, n;
+
+	if (size)
+		buf[0] = '\0';
+
+	for (i = 0; i < trace->spans && len < size; ++i) {
+		if (trace->span[i].index < 0)
+			n = snprintf(buf + len, size - len, "%s%s=%luus", i ? " " : "",
+			             trace->span[i].name,
+			             (unsigned long) (trace->span[i].end - trace->span[i].start));
+		else
+			n = snprintf(buf + len, size - len, "%s%s.%d=%luus", i ? " " : "",
+			             trace->span[i].name, trace->span[i].index,
+			             (unsigned long) (trace->span[i].end - trace->span[i].start));
+
+		if (n < 0)
+			return n;
+
+		len += n;
+	}
+
+	return len;
+}
@@ -0,0 +1,84 @@
+#!/usr/bin/python
+
+import argparse
+import glob
+import os
+
+from collections import defaultdict
+
+def make_args_parser():
+    # create an ArgumentParser object
+    parser = argparse.ArgumentParser(
+        description='Print the timeline of traced queries (see include/trace.h)')
+    # fill parser with information about program arguments
+    parser.add_argument('--traceDir', default='traces',
+                        help='Directory with the trace files', metavar='')
+    parser.add_argument('--id', default=None,
+                        help='Only this trace id', metavar='')
+    parser.add_argument('--slowest', default=0, type=int,
+                        help='Only the N slowest traces', metavar='')
+    parser.add_argument('--width', default=60, type=int,
+                        help='Width of the timeline bars', metavar='')
+    # return an ArgumentParser object
+    return parser.parse_args()
+
+def read_spans(trace_dir):
+    """
+    Spans of all the trace files, grouped by trace id.
+    Line format: <id> <process> <pid> <span> <start> <end> [<detail>]
+    """
+    traces = defaultdict(list)
+    for path in glob.glob(os.path.join(trace_dir, '*.*')):
+        with open(path) as trace_file:
+            for line in trace_file:
+                fields = line.rstrip('\n').split(' ', 6)
+                if len(fields) < 6:
+                    continue
+                trace_id, process, pid, span, start, end = fields[:6]
+                detail = fields[6] if len(fields) > 6 else ''
+                traces[trace_id].append({
+                    'process': process, 'pid': pid, 'span': span,
+                    'start': int(start), 'end': int(end), 'detail': detail})
+    return traces
+
+def duration(spans):
+    return max(s['end'] for s in spans) - min(s['start'] for s in spans)
+
+def print_trace(trace_id, spans, width):
+    begin = min(s['start'] for s in spans)
+    total = max(duration(spans), 1)
+    query = next((s['detail'] for s in spans if s['process'] == 'client'),
+                 spans[0]['detail'])
+
+    print('%s: %s (%.3f ms)' % (trace_id, query, total / 1000.0))
+
+    # Hops in order of appearance, longest first when they start together
+    for s in sorted(spans, key=lambda s: (s['start'], s['start'] - s['end'])):
+        offset = (s['start'] - begin) * width // total
+        length = max((s['end'] - s['start']) * width // total, 1)
+        print('  %-8s %-12s %9.3f %9.3f  |%s%s%s|' % (
+            s['process'], s['span'],
+            (s['start'] - begin) / 1000.0, (s['end'] - s['start']) / 1000.0,
+            ' ' * offset, '#' * length, ' ' * max(width - offset - length, 0)))
+    print()
+
+def main():
+    args = make_args_parser()
+    traces = read_spans(args.traceDir)
+
+    if args.id:
+        traces = {args.id: traces.get(args.id, [])}
+
+    ids = [i for i in traces if traces[i]]
+    if args.slowest:
+        ids = sorted(ids, key=lambda i: duration(traces[i]), reverse=True)
+        ids = ids[:args.slowest]
+    else:
+        ids = sorted(ids, key=lambda i: min(s['start'] for s in traces[i]))
+
+    print('  %-8s %-12s %9s %9s' % ('process', 'span', 'start ms', 'took ms'))
+    for trace_id in ids:
+        print_trace(trace_id, traces[trace_id], args.width)
+
+if __name__ == '__main__':
+    main()